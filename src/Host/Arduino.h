@@ -0,0 +1,292 @@
+#pragma once
+
+// Just enough of the Arduino core to build the sketches on a PC, for the host targets in this
+// directory.  Each target is a single translation unit (the same as a sketch), so everything is
+// defined right here.
+//
+// The time is simulated.  micros() moves on a little every time it is read, standing in for the
+// code that ran since the last read, and delay() moves it on by however long was asked.  That
+// keeps every run the same, which the replays rely on.  Define HOST_REAL_TIME to use the PC's
+// own clock instead (for the benchmarks).
+//
+// All the state is kept per thread, so the fleet can run a separate unit on each one.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#ifdef HOST_REAL_TIME
+#include <chrono>
+#endif
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+// There is only the one address space, so the flash is just memory.
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define strlen_P strlen
+#define strncpy_P strncpy
+#define memcmp_P memcmp
+#define memcpy_P memcpy
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+namespace Host
+{
+  // Roughly what the code between two reads of the clock costs on the board.
+  static const unsigned long MicrosPerCall = 4;
+
+  thread_local uint64_t micros = 0;
+  thread_local uint8_t pins[64];
+  thread_local int analog[8] = { 512, 512, 512, 512, 512, 512, 512, 512 };
+}
+
+inline unsigned long micros()
+{
+#ifdef HOST_REAL_TIME
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+#else
+  Host::micros += Host::MicrosPerCall;
+  return Host::micros;
+#endif
+}
+
+inline unsigned long millis()
+{
+  return micros() / 1000;
+}
+
+inline void delayMicroseconds(unsigned int us)
+{
+#ifdef HOST_REAL_TIME
+  unsigned long start = micros();
+  while ( micros() - start < us )
+  {
+  }
+#else
+  Host::micros += us;
+#endif
+}
+
+inline void delay(unsigned long ms)
+{
+#ifdef HOST_REAL_TIME
+  unsigned long start = millis();
+  while ( millis() - start < ms )
+  {
+  }
+#else
+  Host::micros += (uint64_t)ms * 1000;
+#endif
+}
+
+inline void yield()
+{
+}
+
+inline void noInterrupts()
+{
+}
+
+inline void interrupts()
+{
+}
+
+// An input with its pull up reads high, like a button that isn't pressed.
+inline void pinMode(uint8_t pin, uint8_t mode)
+{
+  if ( INPUT_PULLUP == mode )
+  {
+    Host::pins[pin] = HIGH;
+  }
+}
+
+inline int digitalRead(uint8_t pin)
+{
+  return Host::pins[pin];
+}
+
+inline void digitalWrite(uint8_t pin, uint8_t value)
+{
+  Host::pins[pin] = value;
+}
+
+inline int analogRead(uint8_t pin)
+{
+  return Host::analog[(pin >= A0 ? pin - A0 : pin) & 7];
+}
+
+inline bool isDigit(int c)
+{
+  return isdigit(c);
+}
+
+class Print
+{
+  public:
+
+    virtual ~Print()
+    {
+    }
+
+    virtual size_t write(uint8_t c) = 0;
+
+    size_t write(const uint8_t * buffer, size_t size)
+    {
+      for ( size_t i = 0; i < size; ++i )
+      {
+        write(buffer[i]);
+      }
+      return size;
+    }
+
+    size_t print(const __FlashStringHelper * text)
+    {
+      return print(reinterpret_cast<const char *>(text));
+    }
+
+    size_t print(const char * text)
+    {
+      return write(reinterpret_cast<const uint8_t *>(text), strlen(text));
+    }
+
+    size_t print(char c)
+    {
+      return write(c);
+    }
+
+    size_t print(int value)
+    {
+      return print((long)value);
+    }
+
+    size_t print(unsigned int value)
+    {
+      return print((unsigned long)value);
+    }
+
+    size_t print(unsigned char value)
+    {
+      return print((unsigned long)value);
+    }
+
+    size_t print(long value)
+    {
+      char buffer[24];
+      snprintf(buffer, sizeof(buffer), "%ld", value);
+      return print(buffer);
+    }
+
+    size_t print(unsigned long value)
+    {
+      char buffer[24];
+      snprintf(buffer, sizeof(buffer), "%lu", value);
+      return print(buffer);
+    }
+
+    size_t print(double value, int digits = 2)
+    {
+      char buffer[48];
+      snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+      return print(buffer);
+    }
+
+    size_t println()
+    {
+      return print('\n');
+    }
+
+    template <typename T>
+    size_t println(T value)
+    {
+      return print(value) + println();
+    }
+};
+
+class Stream : public Print
+{
+  public:
+
+    virtual int available() = 0;
+    virtual int read() = 0;
+
+    size_t readBytes(uint8_t * buffer, size_t length)
+    {
+      size_t count = 0;
+      for ( ; count < length; ++count )
+      {
+        int c = read();
+        if ( c < 0 )
+        {
+          break;
+        }
+        buffer[count] = c;
+      }
+      return count;
+    }
+
+    size_t readBytes(char * buffer, size_t length)
+    {
+      return readBytes(reinterpret_cast<uint8_t *>(buffer), length);
+    }
+};
+
+// The serial port is stdin and stdout.  A read blocks till there is something to read (like one
+// with a long timeout), and only fails once stdin is closed.
+class HardwareSerial : public Stream
+{
+  public:
+
+    void begin(unsigned long)
+    {
+    }
+
+    int available()
+    {
+      return 0;
+    }
+
+    int read()
+    {
+      int c = getchar();
+      return EOF == c ? -1 : c;
+    }
+
+    size_t write(uint8_t c)
+    {
+      putchar(c);
+      return 1;
+    }
+
+    using Print::write;
+};
+
+HardwareSerial Serial;
@@ -0,0 +1,78 @@
+#pragma once
+
+// The EEPROM library on the host is just RAM, which starts out erased (all 0xFF) like a new
+// board.  It counts the writes the same way as the wear on a real one would.
+
+#include <stdint.h>
+#include <string.h>
+
+class EEPROMClass
+{
+  public:
+
+    EEPROMClass()
+      : _writes(0)
+    {
+      memset(_bytes, 0xFF, sizeof(_bytes));
+    }
+
+    uint8_t read(int address)
+    {
+      return _bytes[address];
+    }
+
+    void write(int address, uint8_t value)
+    {
+      _bytes[address] = value;
+      ++_writes;
+    }
+
+    void update(int address, uint8_t value)
+    {
+      if ( _bytes[address] != value )
+      {
+        write(address, value);
+      }
+    }
+
+    template <typename T>
+    T & get(int address, T & value)
+    {
+      memcpy(&value, &_bytes[address], sizeof(T));
+      return value;
+    }
+
+    template <typename T>
+    const T & put(int address, const T & value)
+    {
+      const uint8_t * bytes = reinterpret_cast<const uint8_t *>(&value);
+      for ( size_t i = 0; i < sizeof(T); ++i )
+      {
+        update(address + i, bytes[i]);
+      }
+      return value;
+    }
+
+    // Back to how a new board comes, for a program that runs through more than one.
+    void Erase()
+    {
+      memset(_bytes, 0xFF, sizeof(_bytes));
+    }
+
+    uint16_t length()
+    {
+      return sizeof(_bytes);
+    }
+
+    unsigned long GetWrites()
+    {
+      return _writes;
+    }
+
+  private:
+
+    uint8_t _bytes[1024];
+    unsigned long _writes;
+};
+
+EEPROMClass EEPROM;
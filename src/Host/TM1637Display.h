@@ -0,0 +1,12 @@
+#pragma once
+
+// DisplaySegments clocks the bus itself, so all it needs from the library are the segment names.
+
+#define SEG_A   0b00000001
+#define SEG_B   0b00000010
+#define SEG_C   0b00000100
+#define SEG_D   0b00001000
+#define SEG_E   0b00010000
+#define SEG_F   0b00100000
+#define SEG_G   0b01000000
+#define SEG_DP  0b10000000
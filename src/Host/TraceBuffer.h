@@ -0,0 +1,78 @@
+#pragma once
+
+// Builds a trace (see Trace.h) in memory, for the host programs that script their own input.
+// The replay can read it straight back out, or it can be written out for one to read later.
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <vector>
+
+#include "Trace.h"
+
+class TraceBuffer : public Stream
+{
+  public:
+
+    TraceBuffer()
+      : _read(0)
+      , _time(0)
+      , _records(0)
+    {
+      for ( uint8_t i = 0; i < sizeof(TraceMagic); ++i )
+      {
+        _bytes.push_back(pgm_read_byte(&TraceMagic[i]));
+      }
+    }
+
+    // The times are in ms from the start of the trace, and have to come in order.
+    void Add(TraceRecordType type, uint8_t id, unsigned long time)
+    {
+      _bytes.push_back((type << 5) | id);
+      AddVarint(time - _time);
+      _time = time;
+      ++_records;
+    }
+
+    // For the records that carry a value after their time.
+    void AddVarint(unsigned long value)
+    {
+      while ( value >= 0x80 )
+      {
+        _bytes.push_back(value | 0x80);
+        value >>= 7;
+      }
+      _bytes.push_back(value);
+    }
+
+    unsigned long GetRecords()
+    {
+      return _records;
+    }
+
+    void Write(FILE * out)
+    {
+      fwrite(_bytes.data(), 1, _bytes.size(), out);
+    }
+
+    int available()
+    {
+      return _bytes.size() - _read;
+    }
+
+    int read()
+    {
+      return _read < _bytes.size() ? _bytes[_read++] : -1;
+    }
+
+    size_t write(uint8_t)
+    {
+      return 0;
+    }
+
+  private:
+
+    std::vector<uint8_t> _bytes;
+    size_t _read;
+    unsigned long _time;
+    unsigned long _records;
+};
@@ -0,0 +1,35 @@
+// Runs the Thermostat benchmarks on the PC, against its own clock.  Here we can count every
+// allocation too, since there is no core operator new for ours to clash with.
+
+#define HOST_REAL_TIME
+#define BENCHMARK_ALLOCATIONS
+
+#include <Arduino.h>
+
+unsigned long benchmarkAllocations = 0;
+
+void * operator new(size_t size)
+{
+  ++benchmarkAllocations;
+  return malloc(size);
+}
+
+void operator delete(void * ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+#include "Benchmark.h"
+#include "config.h"
+
+int main()
+{
+  Benchmark benchmark(Serial);
+  benchmark.RunAll(PIN_DISPLAY_CLK, PIN_DISPLAY_DIO, PIN_BUTTON_RED);
+  return 0;
+}
@@ -0,0 +1,628 @@
+// Throws a seeded stream of random presses (with bounces) at the buttons, replayed on the virtual
+// clock, and checks that:
+//
+//   - every clean press is seen once, and no bounce is taken for a press of its own
+//   - every press ends in exactly one short press, long press or run of repeats, and which one
+//     matches how long it was held (away from the edges, where either could be right)
+//   - the display never leaves config mode before its time out, or stays in it past that with
+//     nothing pressed
+//
+// The random presses are then run again with the time wrapping part way through (see
+// Clock::WrapIn()), so they go across it.
+//
+// And then with a fixed script, that the long presses still work in config mode and how long a
+// hold takes to run the trigger temp across its whole range.
+//
+// It exits non-zero on the first failure, printing the seed so the run can be repeated, and
+// otherwise prints how many events it got through a second (and the hold timings).
+//
+//   build/buttons [seed] [presses]
+
+#include <Arduino.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "ArduinoWorker.h"
+#include "PersistedData.h"
+#include "SimulatedSensor.h"
+#include "Thermostat.h"
+#include "RelayControl.h"
+#include "HeatDisplay.h"
+#include "ButtonPress.h"
+#include "Trace.h"
+#include "TraceBuffer.h"
+
+static const uint8_t PinRed = 12;
+static const uint8_t PinBlue = 11;
+
+// How far into the presses to put the wrap, when there is one.
+static const unsigned long WrapAfter = 5 /*minutes*/ * 60 * 1000UL;
+
+static unsigned long seed = 1;
+
+static void Fail(const char * what, unsigned long press, unsigned long time)
+{
+  printf("FAILED (seed %lu): %s at press %lu, %lu ms\n", seed, what, press, time);
+  exit(1);
+}
+
+// Scripts the presses.  Each one is a burst of bounces, a clean hold, another burst on the way up
+// and then a clean gap.  The clean parts are always long enough for the debounce to see them.
+class PressScript
+{
+  public:
+
+    struct Press
+    {
+      uint8_t pin;
+      unsigned long down;  // ms into the trace of the last bounce down
+      unsigned long hold;  // ms from the last bounce down to the first bounce up
+      bool repeat;         // whether the repeat handler takes the hold
+    };
+
+    PressScript(unsigned long seed)
+      : _random(seed)
+      , _time(100)
+    {
+    }
+
+    void Generate(TraceBuffer & trace, unsigned long count, bool bothButtons, unsigned long longGapPercent)
+    {
+      for ( unsigned long i = 0; i < count; ++i )
+      {
+        Press press;
+        press.pin = ( bothButtons && Pick(2) ) ? PinBlue : PinRed;
+        press.hold = Pick(100) < 70 ? Between(120, 600) : Between(600, 4000);
+        press.repeat = Pick(2);
+
+        Bounce(trace, press.pin, true);
+        press.down = _time;
+        presses.push_back(press);
+        trace.Add(TraceButtonDown, press.pin, _time);
+        _time += press.hold;
+        Bounce(trace, press.pin, false);
+        trace.Add(TraceButtonUp, press.pin, _time);
+        _time += Pick(100) < longGapPercent ? Between(6000, 12000) : Between(120, 1500);
+      }
+      trace.Add(TraceEnd, 0, _time + 10000);
+    }
+
+    std::vector<Press> presses;
+
+  private:
+
+    // A few edges, each quicker than the debounce, ending in the opposite state to where it goes.
+    void Bounce(TraceBuffer & trace, uint8_t pin, bool down)
+    {
+      unsigned long bounces = Pick(4);
+      for ( unsigned long i = 0; i < bounces; ++i )
+      {
+        trace.Add(down ? TraceButtonDown : TraceButtonUp, pin, _time);
+        _time += Between(1, 8);
+        trace.Add(down ? TraceButtonUp : TraceButtonDown, pin, _time);
+        _time += Between(1, 8);
+      }
+    }
+
+    unsigned long Pick(unsigned long range)
+    {
+      return _random() % range;
+    }
+
+    unsigned long Between(unsigned long low, unsigned long high)
+    {
+      return low + Pick(high - low + 1);
+    }
+
+    std::mt19937 _random;
+    unsigned long _time;
+};
+
+// Counts what each press ended up as, straight off one button.
+class PressCounter
+{
+  public:
+
+    PressCounter(PressScript & script)
+      : _script(script)
+      , _pressed(0)
+      , _shorts(0)
+      , _longs(0)
+      , _repeats(0)
+    {
+    }
+
+    void OnPress(bool &)
+    {
+      Finish();
+      if ( _pressed >= _script.presses.size() )
+      {
+        Fail("an extra press", _pressed, Clock::Now());
+      }
+      ++_pressed;
+      _shorts = _longs = _repeats = 0;
+    }
+
+    void OnShortPress()
+    {
+      ++_shorts;
+    }
+
+    void OnLongPress()
+    {
+      ++_longs;
+    }
+
+    void OnRepeat(bool & repeated)
+    {
+      repeated = _script.presses[_pressed - 1].repeat;
+      if ( repeated )
+      {
+        ++_repeats;
+      }
+    }
+
+    // Checks how the last press ended.
+    void Finish()
+    {
+      if ( 0 == _pressed )
+      {
+        return;
+      }
+      const PressScript::Press & press = _script.presses[_pressed - 1];
+      bool repeated = _repeats > 0;
+      if ( _shorts + _longs + ( repeated ? 1 : 0 ) != 1 )
+      {
+        Fail("a press that didn't end in exactly one action", _pressed, Clock::Now());
+      }
+
+      // The debounce can move the hold by up to two checks either way.
+      const unsigned long slack = 120;
+      bool isShort = press.hold + slack < HeatDisplay::BUTTON_REPEAT_DELAY;
+      bool isHold = press.hold > HeatDisplay::BUTTON_REPEAT_DELAY + slack;
+      bool isLong = press.hold > HeatDisplay::BUTTON_LONG_PRESS + slack;
+      bool isNotLong = press.hold + slack < HeatDisplay::BUTTON_LONG_PRESS;
+      if ( ( isShort && !_shorts ) ||
+           ( isHold && press.repeat && !repeated ) ||
+           ( isHold && !press.repeat && isLong && !_longs ) ||
+           ( isHold && !press.repeat && isNotLong && !_shorts ) )
+      {
+        Fail("a press that ended in the wrong action", _pressed, Clock::Now());
+      }
+    }
+
+    unsigned long GetPressed()
+    {
+      return _pressed;
+    }
+
+  private:
+
+    PressScript & _script;
+    unsigned long _pressed;
+    unsigned long _shorts;
+    unsigned long _longs;
+    unsigned long _repeats;
+};
+
+// The display and both buttons wired up the same as the sketch.
+class Panel
+{
+  public:
+
+    Panel()
+      : sensor(25)
+      , thermostat(&sensor, &storage, &bus)
+      , relay(6, &storage)
+      , display(8, 9, &storage, &thermostat, &relay)
+      , buttonRed(PinRed)
+      , buttonBlue(PinBlue)
+    {
+      // Clocking the frames out would take most of the time, and none of the checks look at it.
+      display.GetSegments().SetBusless(true);
+      worker.AddWorker(&thermostat, &Thermostat::RefreshTemp, PriorityControl);
+      display.RegisterTimers(&worker);
+      worker.AddPassCompleteHandler(&bus, &EventBus::Dispatch);
+      worker.AddPassCompleteHandler(&display, &HeatDisplay::Render);
+
+      buttonRed.RegisterPressHandler(&display, &HeatDisplay::OnButtonPress);
+      buttonRed.RegisterShortPressHandler(&display, &HeatDisplay::ChangeConfigUp);
+      buttonRed.RegisterLongPressHandler(&display, &HeatDisplay::ChangeConfigMode, HeatDisplay::BUTTON_LONG_PRESS);
+      buttonRed.RegisterRepeatHandler(&display, &HeatDisplay::RepeatConfigUp, HeatDisplay::BUTTON_REPEAT_DELAY);
+      worker.AddWorker(&buttonRed, &ButtonPress::CheckButton, PriorityInput);
+
+      buttonBlue.RegisterPressHandler(&display, &HeatDisplay::OnButtonPress);
+      buttonBlue.RegisterShortPressHandler(&display, &HeatDisplay::ChangeConfigDown);
+      buttonBlue.RegisterLongPressHandler(&display, &HeatDisplay::ChangeMeasurement, HeatDisplay::BUTTON_LONG_PRESS);
+      buttonBlue.RegisterRepeatHandler(&display, &HeatDisplay::RepeatConfigDown, HeatDisplay::BUTTON_REPEAT_DELAY);
+      worker.AddWorker(&buttonBlue, &ButtonPress::CheckButton, PriorityInput);
+    }
+
+    bool Replay(TraceBuffer & trace)
+    {
+      TraceReplay replay(&worker);
+      replay.AddButton(&buttonRed);
+      replay.AddButton(&buttonBlue);
+      return replay.Run(trace);
+    }
+
+    ArdunioWorker worker;
+    EventBus bus;
+    PersistedData storage;
+    SimulatedSensor sensor;
+    Thermostat thermostat;
+    RelayControl relay;
+    HeatDisplay display;
+    ButtonPress buttonRed;
+    ButtonPress buttonBlue;
+};
+
+// Watches the display from the end of every pass for config mode ending before or outliving its
+// time out.
+class ConfigWatch
+{
+  public:
+
+    ConfigWatch(HeatDisplay * display, ButtonPress * red, ButtonPress * blue)
+      : _display(display)
+      , _red(red)
+      , _blue(blue)
+      , _lastEdge(0)
+      , _configModes(0)
+      , _lastShortPress(0)
+      , _wasConfig(false)
+    {
+    }
+
+    void OnEdge(const ButtonPress &)
+    {
+      _lastEdge = Clock::Now();
+    }
+
+    // A press is handled with the button down, and a short press once it's let go.
+    void OnHandled(const ButtonPress & button)
+    {
+      if ( !button.IsPressed() )
+      {
+        _lastShortPress = Clock::Now();
+      }
+    }
+
+    void OnPassComplete(unsigned long &)
+    {
+      // Every short press (re)starts the time out, so it can't end any sooner than that after the
+      // last one.  A timer that went off too soon (like one due just past a wrap) would end it
+      // early.
+      const unsigned long timeOut = 5 /*seconds*/ * 1000;
+      bool config = _display->IsConfigMode();
+      if ( config && !_wasConfig )
+      {
+        ++_configModes;
+      }
+      else if ( !config && _wasConfig && ( Clock::Now() - _lastShortPress < timeOut ) )
+      {
+        Fail("config mode that timed out early", 0, Clock::Now());
+      }
+      _wasConfig = config;
+
+      // A hold keeps it in config mode (with repeats), so only the time since a button was last
+      // let go counts.  It has a pass or two of slack for the time out timer to come round.
+      if ( config && !_red->IsPressed() && !_blue->IsPressed() && ( Clock::Now() - _lastEdge > timeOut + 100 ) )
+      {
+        Fail("config mode that didn't time out", 0, Clock::Now());
+      }
+    }
+
+    unsigned long GetConfigModes()
+    {
+      return _configModes;
+    }
+
+  private:
+
+    HeatDisplay * _display;
+    ButtonPress * _red;
+    ButtonPress * _blue;
+    unsigned long _lastEdge;
+    unsigned long _configModes;
+    unsigned long _lastShortPress;
+    bool _wasConfig;
+};
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Where to have the time wrap for the presses: a second into the first long press after a few
+// minutes, so that press is timed across it.
+static unsigned long WrapInHold(const PressScript & script)
+{
+  for ( const PressScript::Press & press : script.presses )
+  {
+    if ( ( press.down > WrapAfter ) && ( press.hold > HeatDisplay::BUTTON_LONG_PRESS + 1000 ) && !press.repeat )
+    {
+      return press.down + 1000;
+    }
+  }
+  return 0;
+}
+
+// And for config mode: just before the time out of the first short press (after a few minutes)
+// that is left to time out, so the time out is due just past it.  The blink timer goes off a
+// moment before that, which is the last chance for the time out to go off too soon.
+static unsigned long WrapInTimeOut(const PressScript & script)
+{
+  for ( size_t i = 1; i < script.presses.size(); ++i )
+  {
+    const PressScript::Press & last = script.presses[i - 1];
+    unsigned long up = last.down + last.hold;
+    if ( ( last.down > WrapAfter ) && ( last.hold < HeatDisplay::BUTTON_REPEAT_DELAY ) &&
+         ( script.presses[i].down - up > 6000 ) )
+    {
+      return up + 4750;
+    }
+  }
+  return 0;
+}
+
+// Starts the clock again, and if asked to, has it wrap that many ms in.
+static void StartClock(unsigned long wrapIn)
+{
+  Clock::Reset();
+  if ( wrapIn )
+  {
+    Clock::WrapIn(wrapIn);
+  }
+}
+
+// A run that was meant to wrap has to have gone on past it.
+static void CheckWrapped(unsigned long wrapIn)
+{
+  if ( wrapIn && ( Clock::Now64() <= wrapIn ) )
+  {
+    Fail("a run that was meant to but didn't go through the wrap", 0, Clock::Now());
+  }
+}
+
+// One button on its own, with counting handlers.
+static void CheckPresses(unsigned long count, bool wrap)
+{
+  PressScript script(seed);
+  TraceBuffer trace;
+  script.Generate(trace, count, false, 0);
+  unsigned long wrapIn = wrap ? WrapInHold(script) : 0;
+  StartClock(wrapIn);
+
+  ArdunioWorker worker;
+  ButtonPress button(PinRed);
+  PressCounter counter(script);
+  button.RegisterPressHandler(&counter, &PressCounter::OnPress);
+  button.RegisterShortPressHandler(&counter, &PressCounter::OnShortPress);
+  button.RegisterLongPressHandler(&counter, &PressCounter::OnLongPress, HeatDisplay::BUTTON_LONG_PRESS);
+  button.RegisterRepeatHandler(&counter, &PressCounter::OnRepeat, HeatDisplay::BUTTON_REPEAT_DELAY);
+  worker.AddWorker(&button, &ButtonPress::CheckButton, PriorityInput);
+
+  TraceReplay replay(&worker);
+  replay.AddButton(&button);
+
+  auto start = std::chrono::steady_clock::now();
+  if ( !replay.Run(trace) )
+  {
+    Fail("a trace that didn't replay", 0, Clock::Now());
+  }
+  double seconds = Seconds(start);
+  counter.Finish();
+  if ( counter.GetPressed() != script.presses.size() )
+  {
+    Fail("a lost press", counter.GetPressed(), Clock::Now());
+  }
+  CheckWrapped(wrapIn);
+  printf("{\"check\":\"presses\",\"seed\":%lu,\"wrap_in_ms\":%lu,\"presses\":%lu,\"events\":%lu,\"events_per_s\":%.0f}\n",
+    seed, wrapIn, count, trace.GetRecords(), trace.GetRecords() / seconds);
+}
+
+// Random presses of both buttons on the display.
+static void CheckConfigMode(unsigned long count, bool wrap)
+{
+  PressScript script(seed + 1);
+  TraceBuffer trace;
+  script.Generate(trace, count, true, 20);
+  unsigned long wrapIn = wrap ? WrapInTimeOut(script) : 0;
+  StartClock(wrapIn);
+
+  Panel panel;
+  ConfigWatch watch(&panel.display, &panel.buttonRed, &panel.buttonBlue);
+  panel.worker.AddPassCompleteHandler(&watch, &ConfigWatch::OnPassComplete);
+  panel.buttonRed.RegisterEdgeHandler(&watch, &ConfigWatch::OnEdge);
+  panel.buttonBlue.RegisterEdgeHandler(&watch, &ConfigWatch::OnEdge);
+  panel.buttonRed.RegisterHandledHandler(&watch, &ConfigWatch::OnHandled);
+  panel.buttonBlue.RegisterHandledHandler(&watch, &ConfigWatch::OnHandled);
+
+  auto start = std::chrono::steady_clock::now();
+  if ( !panel.Replay(trace) )
+  {
+    Fail("a trace that didn't replay", 0, Clock::Now());
+  }
+  double seconds = Seconds(start);
+  if ( panel.display.IsConfigMode() )
+  {
+    Fail("config mode still on at the end", 0, Clock::Now());
+  }
+  CheckWrapped(wrapIn);
+  printf("{\"check\":\"config\",\"seed\":%lu,\"wrap_in_ms\":%lu,\"presses\":%lu,\"config_modes\":%lu,\"events\":%lu,\"events_per_s\":%.0f}\n",
+    seed, wrapIn, count, watch.GetConfigModes(), trace.GetRecords(), trace.GetRecords() / seconds);
+}
+
+// Notes the settings at the end of each pass, to see when a hold got where it was going.  The
+// times are from the start of the trace, since the clock carries on from the checks before.
+class HoldWatch
+{
+  public:
+
+    HoldWatch(Panel * panel)
+      : _panel(panel)
+      , _start(0)
+      , _probeAt(0)
+      , _expected(0)
+      , _reachedAt(0)
+    {
+    }
+
+    void Start()
+    {
+      _start = Clock::Now();
+    }
+
+    // Takes the settings as of the first pass from the given time.
+    void Probe(unsigned long time)
+    {
+      _probeAt = time;
+    }
+
+    // Notes the first pass from now that the trigger is at the given temp (in fahrenheit).
+    void Expect(int fahrenheit)
+    {
+      _expected = fahrenheit;
+      _reachedAt = 0;
+    }
+
+    void OnPassComplete(unsigned long &)
+    {
+      unsigned long now = Clock::Now() - _start;
+      if ( _probeAt && ( now >= _probeAt ) )
+      {
+        _probeAt = 0;
+        trigger = _panel->thermostat.GetTriggerTemp(false);
+        brightness = _panel->storage.get_LedBrigtness();
+        celsius = _panel->storage.get_Celsius();
+      }
+      if ( !_reachedAt && ( _panel->thermostat.GetTriggerTemp(false) == _expected ) )
+      {
+        _reachedAt = now;
+      }
+    }
+
+    unsigned long GetReachedAt()
+    {
+      return _reachedAt;
+    }
+
+    int trigger;
+    uint8_t brightness;
+    bool celsius;
+
+  private:
+
+    Panel * _panel;
+    unsigned long _start;
+    unsigned long _probeAt;
+    int _expected;
+    unsigned long _reachedAt;
+};
+
+// A fixed script of taps and holds (without bounces), run a step at a time.
+static void Press(TraceBuffer & trace, uint8_t pin, unsigned long down, unsigned long up)
+{
+  trace.Add(TraceButtonDown, pin, down);
+  trace.Add(TraceButtonUp, pin, up);
+}
+
+static void Run(Panel & panel, HoldWatch & watch, TraceBuffer & trace, unsigned long end)
+{
+  trace.Add(TraceEnd, 0, end);
+  watch.Start();
+  if ( !panel.Replay(trace) )
+  {
+    Fail("a trace that didn't replay", 0, Clock::Now());
+  }
+}
+
+// The long presses have to work in config mode as well as out of it, and a hold after a tap
+// should run the trigger across its whole range in about a second rather than dozens of taps.
+static void CheckHolds()
+{
+  const unsigned long settle = 500;
+  const unsigned long maxHold = 1500;
+  const int minF = 32;
+  const int maxF = 122;
+
+  // Held outside config mode, blue switches to fahrenheit.  Then in config mode (before any
+  // change) red switches to the brightness and blue can turn it down.  Each starts from the
+  // defaults, rather than whatever the random presses left.
+  {
+    EEPROM.Erase();
+    Panel panel;
+    HoldWatch watch(&panel);
+    panel.worker.AddPassCompleteHandler(&watch, &HoldWatch::OnPassComplete);
+    int trigger = panel.thermostat.GetTriggerTemp(false);
+    uint8_t brightness = panel.storage.get_LedBrigtness();
+    TraceBuffer trace;
+    Press(trace, PinBlue, 1000, 4000);
+    Press(trace, PinRed, 5000, 5100);
+    Press(trace, PinRed, 6000, 9000);
+    Press(trace, PinBlue, 10000, 10100);
+    watch.Probe(10000 + settle);
+    Run(panel, watch, trace, 20000);
+    if ( watch.celsius || ( watch.trigger != trigger ) || ( watch.brightness != brightness - 1 ) )
+    {
+      Fail("a long press that didn't happen in config mode", 0, Clock::Now());
+    }
+  }
+
+  // In fahrenheit (for the most steps), a tap and then a hold down to the bottom and back up
+  // to the top.
+  unsigned long down;
+  unsigned long up;
+  {
+    EEPROM.Erase();
+    Panel panel;
+    HoldWatch watch(&panel);
+    panel.worker.AddPassCompleteHandler(&watch, &HoldWatch::OnPassComplete);
+    TraceBuffer trace;
+    Press(trace, PinBlue, 1000, 4000);
+    Press(trace, PinBlue, 10000, 10100);
+    Press(trace, PinBlue, 10500, 10600);
+    Press(trace, PinBlue, 11000, 30000);
+    watch.Expect(minF);
+    Run(panel, watch, trace, 30000 + settle);
+    down = watch.GetReachedAt() - 11000;
+    if ( !watch.GetReachedAt() )
+    {
+      Fail("a hold that didn't reach the bottom", 0, Clock::Now());
+    }
+
+    TraceBuffer trace2;
+    Press(trace2, PinRed, 100, 200);
+    Press(trace2, PinRed, 600, 20000);
+    watch.Expect(maxF);
+    Run(panel, watch, trace2, 20000 + settle);
+    up = watch.GetReachedAt() - 600;
+    if ( !watch.GetReachedAt() )
+    {
+      Fail("a hold that didn't reach the top", 0, Clock::Now());
+    }
+  }
+  if ( ( down > maxHold ) || ( up > maxHold ) )
+  {
+    Fail("a hold that took too long to cross the range", 0, Clock::Now());
+  }
+
+  printf("{\"check\":\"holds\",\"hold_down_ms\":%lu,\"down_steps\":%d,\"hold_up_ms\":%lu,\"up_steps\":%d}\n",
+    down, 86 - 1 - minF, up, maxF - minF - 1);
+}
+
+int main(int argc, char * argv[])
+{
+  seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1;
+  unsigned long count = argc > 2 ? strtoul(argv[2], nullptr, 0) : 10000;
+  CheckPresses(count, false);
+  CheckConfigMode(count, false);
+  CheckHolds();
+
+  // Then again with the time wrapping part way through.
+  CheckPresses(count, true);
+  CheckConfigMode(count, true);
+  return 0;
+}
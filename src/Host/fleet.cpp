@@ -0,0 +1,287 @@
+// Runs a whole fleet of simulated units at once, to see how the thermostat copes across installs
+// that aren't all the same.  Each unit is the control side of the sketch (a zone's thermostat,
+// relay and persisted data, without the display or buttons) closing the loop through its own
+// SimulatedPlant on its own virtual clock, with its own EEPROM image.  The plants and triggers
+// are varied from the seed and the unit's number, so a unit comes out the same whichever thread
+// runs it and a run can be repeated exactly.
+//
+// The units are shared out over the threads with work stealing: each thread works through its
+// own queue and then takes from the others once that runs out, so a few slow units can't leave
+// the rest of the threads idle.  At the end the relay switches (per day), overshoot, undershoot
+// (both in hundredths of a degree) and EEPROM writes are summed up across the fleet.
+//
+// The first line of output is the fleet, the second how fast it ran (which is the only part that
+// changes from run to run).
+//
+//   build/fleet [units] [days] [threads] [seed]
+
+#define UNIT_LOCAL thread_local
+
+#include <Arduino.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "ArduinoWorker.h"
+#include "EventBus.h"
+#include "PersistedData.h"
+#include "SimulatedSensor.h"
+#include "Thermostat.h"
+#include "RelayControl.h"
+#include "SimulatedPlant.h"
+#include "Trace.h"
+#include "TraceBuffer.h"
+
+static const uint8_t PinRelay = 6;
+
+// How one install differs from the next.
+struct UnitParams
+{
+  int triggerFahrenheit;
+  int sourceCelsius;
+  int coilCelsius;
+  long sourceTime;
+  long coilTime;
+  long roomTime;
+};
+
+struct UnitResult
+{
+  unsigned long switches;
+  unsigned long onSeconds;
+  long overshoot;
+  long undershoot;
+  unsigned long eepromWrites;
+};
+
+static UnitParams MakeParams(unsigned long seed, unsigned long unit)
+{
+  std::seed_seq seq = { seed, unit };
+  std::mt19937 random(seq);
+  auto between = [&random](long low, long high) { return low + (long)(random() % (high - low + 1)); };
+  UnitParams params;
+  params.triggerFahrenheit = between(78, 90);
+  params.sourceCelsius = between(38, 50);
+  params.coilCelsius = between(2, 10);
+  params.sourceTime = between(5000, 10000);
+  params.coilTime = between(60, 300);
+  params.roomTime = between(3000, 6000);
+  return params;
+}
+
+// The parts of the sketch that run a zone, wired up the same way.
+class Unit
+{
+  public:
+
+    // The EEPROM image is the unit's own, and only has to last as long as it does.
+    Unit(const UnitParams & params, uint8_t * image)
+      : storage(image)
+      , thermostat(&sensor, &storage, &bus)
+      , relay(PinRelay, &storage)
+      , plant(&sensor, &relay, &thermostat, 20, params.sourceCelsius, params.coilCelsius,
+              params.sourceTime, params.coilTime, params.roomTime)
+    {
+      bus.Subscribe(EventRelay, &relay, &RelayControl::OnRelayEvent, 0);
+      worker.AddWorker(&thermostat, &Thermostat::RefreshTemp, PriorityControl);
+      worker.AddWorker(&plant, &SimulatedPlant::Step, PriorityControl);
+      worker.AddWorker(&relay, &RelayControl::UpdateStats, PriorityPersistence);
+      worker.AddWorker(&storage, &PersistedData::SaveData, PriorityPersistence);
+      worker.AddPassCompleteHandler(&bus, &EventBus::Dispatch);
+
+      // Set the same way the installer would with the buttons.
+      while ( thermostat.GetTriggerTemp(false) < params.triggerFahrenheit )
+      {
+        thermostat.IncTriggerTemp(false);
+      }
+      while ( thermostat.GetTriggerTemp(false) > params.triggerFahrenheit )
+      {
+        thermostat.DecTriggerTemp(false);
+      }
+    }
+
+    bool Run(unsigned long days, UnitResult & result)
+    {
+      // Nothing in the trace but its end, so the replay just runs the clock for that long.
+      TraceBuffer trace;
+      trace.Add(TraceEnd, 0, days * 24 * 60 * 60 * 1000);
+      TraceReplay replay(&worker);
+      if ( !replay.Run(trace) )
+      {
+        return false;
+      }
+      result.switches = relay.GetSwitches();
+      result.onSeconds = relay.GetOnSeconds();
+      result.overshoot = plant.GetMaxOvershoot();
+      result.undershoot = plant.GetMaxUndershoot();
+      result.eepromWrites = storage.GetEepromWrites();
+      return true;
+    }
+
+  private:
+
+    ArdunioWorker worker;
+    EventBus bus;
+    PersistedData storage;
+    SimulatedSensor sensor;
+    Thermostat thermostat;
+    RelayControl relay;
+    SimulatedPlant plant;
+};
+
+// Every thread has its own queue of units.  It takes from the back of its own, and from the
+// front of the others' (the other end from their owners) once it runs out.
+class FleetPool
+{
+  public:
+
+    FleetPool(unsigned threads, unsigned long units)
+      : _queues(threads)
+    {
+      // In blocks, so each thread starts on a run of neighbours.
+      for ( unsigned long unit = 0; unit < units; ++unit )
+      {
+        _queues[unit * threads / units].units.push_back(unit);
+      }
+    }
+
+    template <typename F>
+    void Run(F run)
+    {
+      std::vector<std::thread> threads;
+      for ( unsigned thread = 0; thread < _queues.size(); ++thread )
+      {
+        threads.emplace_back([this, thread, &run]
+        {
+          unsigned long unit;
+          while ( Next(thread, unit) )
+          {
+            run(unit);
+          }
+        });
+      }
+      for ( std::thread & thread : threads )
+      {
+        thread.join();
+      }
+    }
+
+    unsigned long GetSteals()
+    {
+      return _steals;
+    }
+
+  private:
+
+    bool Next(unsigned thread, unsigned long & unit)
+    {
+      {
+        Queue & own = _queues[thread];
+        std::lock_guard<std::mutex> lock(own.lock);
+        if ( !own.units.empty() )
+        {
+          unit = own.units.back();
+          own.units.pop_back();
+          return true;
+        }
+      }
+      // Nothing is ever added once we've started, so once they are all empty we're done.
+      for ( unsigned i = 1; i < _queues.size(); ++i )
+      {
+        Queue & other = _queues[(thread + i) % _queues.size()];
+        std::lock_guard<std::mutex> lock(other.lock);
+        if ( !other.units.empty() )
+        {
+          unit = other.units.front();
+          other.units.pop_front();
+          ++_steals;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    struct Queue
+    {
+      std::mutex lock;
+      std::deque<unsigned long> units;
+    };
+
+    std::vector<Queue> _queues;
+    std::atomic<unsigned long> _steals { 0 };
+};
+
+// Prints the mean, 50th and 99th percentiles and max of one of the results across the fleet.
+template <typename T>
+static void PrintSpread(const char * name, std::vector<UnitResult> & results, T value)
+{
+  std::vector<double> values;
+  double sum = 0;
+  for ( UnitResult & result : results )
+  {
+    values.push_back(value(result));
+    sum += values.back();
+  }
+  std::sort(values.begin(), values.end());
+  auto rank = [&values](double percent) { return values[(size_t)((values.size() - 1) * percent / 100 + 0.5)]; };
+  printf(",\"%s\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}",
+    name, sum / values.size(), rank(50), rank(99), values.back());
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned long units = argc > 1 ? strtoul(argv[1], nullptr, 0) : 256;
+  unsigned long days = argc > 2 ? strtoul(argv[2], nullptr, 0) : 2;
+  unsigned threads = argc > 3 ? strtoul(argv[3], nullptr, 0) : 0;
+  unsigned long seed = argc > 4 ? strtoul(argv[4], nullptr, 0) : 1;
+  if ( !threads )
+  {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min<unsigned long>(threads, std::max(1ul, units));
+  if ( !units || !days || ( days > 40 ) )
+  {
+    printf("Needs at least one unit, and from 1 to 40 days (the clock is 32 bits of ms)\n");
+    return 1;
+  }
+
+  std::vector<UnitResult> results(units);
+  std::atomic<bool> failed { false };
+  FleetPool pool(threads, units);
+  auto start = std::chrono::steady_clock::now();
+  pool.Run([&](unsigned long unit)
+  {
+    // Everything a unit keeps outside its own objects is per thread, and starts again for each.
+    Clock::Reset();
+    Host::micros = 0;
+    memset(Host::pins, 0, sizeof(Host::pins));
+    uint8_t image[PersistedData::IMAGE_SIZE];
+    Unit simulated(MakeParams(seed, unit), image);
+    if ( !simulated.Run(days, results[unit]) )
+    {
+      failed = true;
+    }
+  });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if ( failed )
+  {
+    printf("FAILED: a unit's replay didn't run\n");
+    return 1;
+  }
+
+  printf("{\"units\":%lu,\"days\":%lu,\"seed\":%lu", units, days, seed);
+  PrintSpread("switches_per_day", results, [days](const UnitResult & result) { return (double)result.switches / days; });
+  PrintSpread("duty_percent", results, [days](const UnitResult & result) { return result.onSeconds * 100.0 / (days * 86400); });
+  PrintSpread("overshoot", results, [](const UnitResult & result) { return (double)result.overshoot; });
+  PrintSpread("undershoot", results, [](const UnitResult & result) { return (double)result.undershoot; });
+  PrintSpread("eeprom_writes", results, [](const UnitResult & result) { return (double)result.eepromWrites; });
+  printf("}\n");
+  printf("{\"threads\":%u,\"steals\":%lu,\"seconds\":%.2f,\"units_per_s\":%.1f,\"sim_days_per_s\":%.0f}\n",
+    threads, pool.GetSteals(), seconds, units / seconds, units * days / seconds);
+  return 0;
+}
@@ -0,0 +1,107 @@
+// Writes a trace (see Trace.h) that keeps the buttons busy while the sensor reads block, for the
+// replay built with SIMULATE_PLANT and INPUT_LATENCY to time the presses under load:
+//
+//   build/latency [seed] [minutes] [read cost us] | build/replay-latency
+//
+// It first leaves the plant a couple of hours to come round to the (default) trigger temp, where
+// the sensor is read most often.  Then for the given minutes, over and over, it goes into config
+// mode, runs the trigger temp up past the top with short presses (so the last few blank the
+// display at the limit), holds it there, brings it back down to where it was and leaves config
+// mode to time out.  Each read blocks for the read cost (25ms by default, about what a DHT11
+// takes), so some of the presses land behind a read just like they would on the board.  The seed
+// moves the presses around, so they don't always fall at the same point between two reads.
+
+#include <Arduino.h>
+#include <random>
+
+#include "Trace.h"
+#include "TraceBuffer.h"
+
+static const uint8_t PinRed = 12;
+static const uint8_t PinBlue = 11;
+
+class LoadScript
+{
+  public:
+
+    LoadScript(unsigned long seed)
+      : _random(seed)
+      , _time(0)
+    {
+    }
+
+    void Generate(unsigned long minutes, unsigned long readCost)
+    {
+      _trace.Add(TraceReadCost, 0, _time);
+      _trace.AddVarint(readCost);
+
+      _time = _warmUp;
+      unsigned long end = _warmUp + minutes * 60 * 1000;
+      while ( _time < end )
+      {
+        // Into config mode, then up past the top and hold it there.
+        Press(PinRed, Between(80, 200));
+        Presses(PinRed, _toTop + _pastTop);
+        Press(PinRed, Between(1000, 3000));
+
+        // Back to where it was.
+        Presses(PinBlue, _toTop);
+
+        // Long enough for config mode to time out.
+        _time += Between(12000, 20000);
+      }
+      _trace.Add(TraceEnd, 0, _time);
+    }
+
+    void Write()
+    {
+      _trace.Write(stdout);
+    }
+
+  private:
+
+    void Presses(uint8_t pin, unsigned long count)
+    {
+      for ( unsigned long i = 0; i < count; ++i )
+      {
+        Press(pin, Between(80, 200));
+      }
+    }
+
+    void Press(uint8_t pin, unsigned long hold)
+    {
+      _trace.Add(TraceButtonDown, pin, _time);
+      _time += hold;
+      _trace.Add(TraceButtonUp, pin, _time);
+      _time += Between(120, 400);
+    }
+
+    unsigned long Between(unsigned long low, unsigned long high)
+    {
+      return low + _random() % (high - low + 1);
+    }
+
+    // The plant warms up about 0.1 degree a minute from 20C, so it takes this long to get to the
+    // default trigger temp (30C).
+    static const unsigned long _warmUp = 2 /*hours*/ * 60 * 60 * 1000UL;
+
+    // From the default trigger temp (86F) to the top (122F), and how many more presses after that.
+    static const unsigned long _toTop = 122 - 86;
+    static const unsigned long _pastTop = 4;
+
+    std::mt19937 _random;
+    TraceBuffer _trace;
+    unsigned long _time;
+};
+
+int main(int argc, char * argv[])
+{
+  unsigned long seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1;
+  unsigned long minutes = argc > 2 ? strtoul(argv[2], nullptr, 0) : 30;
+  unsigned long readCost = argc > 3 ? strtoul(argv[3], nullptr, 0) : 25000;
+
+  LoadScript script(seed);
+  script.Generate(minutes, readCost);
+  script.Write();
+  return 0;
+}
@@ -0,0 +1,13 @@
+// Replays a trace from stdin through the whole sketch, on the virtual clock, and writes what the
+// replay recorded to stdout (see Trace.h).  Since the time on the host is simulated too, the same
+// trace always gives the same output, so it can be compared between commits.
+
+#define TRACE_REPLAY_BAUD 115200
+
+#include "main.ino"
+
+int main()
+{
+  setup();
+  return 0;
+}
@@ -3,12 +3,19 @@
 // This can be used to simplify and make more readable the parameters to pass to the Register() method.
 #define PASS_OBJECT_METHOD(obj, method)   &obj,&decltype(obj)::method
 
+// Big enough to hold an object pointer and a method pointer, which is all any handler needs.
+// The pointers are aligned so the callback data can be used in place once it is copied in.
+union CallbackStorage
+{
+  void* align;
+  uint8_t bytes[sizeof(void*) + sizeof(void (CallbackStorage::*)())];
+};
+
 class ArduinoHandler
 {
   public:
     ArduinoHandler()
-      : _callback(nullptr)
-      , _wrapper(nullptr)
+      : _wrapper(nullptr)
     {
     }
 
@@ -25,7 +32,7 @@ class ArduinoHandler
       // We can't story it in the right type because this class is templated,
       // only this method is.  But we can define the type scoped to this method
       // that is type safe to capture the object and method pointers.  Then
-      // store that in a generic member void* pointer as well as the lambda
+      // store that in generic member storage as well as the lambda
       // that knows how to convert it back which is also type specific local to
       // this template method. Tricky, I know.  Took a while to come to this design.
       struct CallbackData {
@@ -33,48 +40,45 @@ class ArduinoHandler
         void (T_CALLBACK_CLASS::*methodPtr)();
       };
 
-      // If they previously had a handler registered, we need to free it up.
+      // If they previously had a handler registered, we need to clear it out.
       Unregister();
 
-      // Allocate the callback data structure to hold the object and method pointers.
-      _callback = static_cast<void*>(new CallbackData{obj, method});
+      // Copy the callback data structure holding the object and method pointers into our own
+      // storage rather than allocating it, so handlers never touch the heap.
+      static_assert(sizeof(CallbackData) <= sizeof(_callback), "Callback data doesn't fit in the handler");
+      CallbackData callbackData{obj, method};
+      memcpy(_callback.bytes, &callbackData, sizeof(callbackData));
 
       // Create the lambda that knows how to convert the void callback data back to
       // the typed data in the structure defined here.
-      _wrapper = [](void* voidCallbackData)
+      _wrapper = [](const void* voidCallbackData)
       {
-          auto* typedCallbackData = static_cast<CallbackData*>(voidCallbackData);
+          auto* typedCallbackData = static_cast<const CallbackData*>(voidCallbackData);
           (typedCallbackData->objectPtr->*typedCallbackData->methodPtr)();
       };
     }
 
     void Unregister()
     {
-      // If they previously had a handler registered, we need to free it up.
-      if ( _callback )
-      {
-        delete _callback;
-        _callback = nullptr;
-      }
       _wrapper = nullptr;
     }
 
     bool HasHandler()
     {
-      return ( _wrapper && _callback );
+      return ( nullptr != _wrapper );
     }
 
     void Invoke()
     {
       if ( HasHandler() )
       {
-        _wrapper(_callback);
+        _wrapper(_callback.bytes);
       }
     }
 
   private:
-    void* _callback;
-    void (*_wrapper)(void*);
+    CallbackStorage _callback;
+    void (*_wrapper)(const void*);
 };
 
 template <typename T_CALLBACK_PARAM>
@@ -82,15 +86,13 @@ class ArduinoHandlerParam
 {
   public:
     ArduinoHandlerParam()
-      : _callback(nullptr)
-      , _wrapper(nullptr)
+      : _wrapper(nullptr)
     {
     }
 
     // template <typename T_CALLBACK_CLASS>
     // ArduinoHandlerParam(T_CALLBACK_CLASS* obj, void (T_CALLBACK_CLASS::*method)(T_CALLBACK_PARAM))
-    //   : _callback(nullptr)
-    //   , _wrapper(nullptr)
+    //   : _wrapper(nullptr)
     // {
     //   Register(obj, method);
     // }
@@ -108,7 +110,7 @@ class ArduinoHandlerParam
       // We can't story it in the right type because this class is templated,
       // only this method is.  But we can define the type scoped to this method
       // that is type safe to capture the object and method pointers.  Then
-      // store that in a generic member void* pointer as well as the lambda
+      // store that in generic member storage as well as the lambda
       // that knows how to convert it back which is also type specific local to
       // this template method. Tricky, I know.  Took a while to come to this design.
       struct CallbackData {
@@ -116,41 +118,43 @@ class ArduinoHandlerParam
         void (T_CALLBACK_CLASS::*methodPtr)(T_CALLBACK_PARAM);
       };
 
-      // If they previously had a handler registered, we need to free it up.
+      // If they previously had a handler registered, we need to clear it out.
       Unregister();
 
-      // Allocate the callback data structure to hold the object and method pointers.
-      _callback = static_cast<void*>(new CallbackData{obj, method});
+      // Copy the callback data structure holding the object and method pointers into our own
+      // storage rather than allocating it, so handlers never touch the heap.
+      static_assert(sizeof(CallbackData) <= sizeof(_callback), "Callback data doesn't fit in the handler");
+      CallbackData callbackData{obj, method};
+      memcpy(_callback.bytes, &callbackData, sizeof(callbackData));
 
       // Create the lambda that knows how to convert the void callback data back to
       // the typed data in the structure defined here.
-      _wrapper = [](void* voidCallbackData, T_CALLBACK_PARAM param)
+      _wrapper = [](const void* voidCallbackData, T_CALLBACK_PARAM param)
       {
-          auto* typedCallbackData = static_cast<CallbackData*>(voidCallbackData);
+          auto* typedCallbackData = static_cast<const CallbackData*>(voidCallbackData);
           (typedCallbackData->objectPtr->*typedCallbackData->methodPtr)(param);
       };
     }
 
     void Unregister()
     {
-      // If they previously had a handler registered, we need to free it up.
-      if ( _callback )
-      {
-        delete _callback;
-        _callback = nullptr;
-      }
       _wrapper = nullptr;
     }
 
+    bool HasHandler()
+    {
+      return ( nullptr != _wrapper );
+    }
+
     void Invoke(T_CALLBACK_PARAM param)
     {
-      if ( _wrapper && _callback )
+      if ( _wrapper )
       {
-        _wrapper(_callback, param);
+        _wrapper(_callback.bytes, param);
       }
     }
 
   private:
-    void* _callback;
-    void (*_wrapper)(void*, T_CALLBACK_PARAM);
+    CallbackStorage _callback;
+    void (*_wrapper)(const void*, T_CALLBACK_PARAM);
 };
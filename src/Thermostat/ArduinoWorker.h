@@ -1,6 +1,18 @@
 #pragma once
 
 #include "ArduinoHandler.h"
+#include "Clock.h"
+
+// Workers run in priority order within a pass, and once the pass has used up its time budget any
+// remaining due workers (other than input) are deferred to the next pass.
+enum WorkerPriority : uint8_t
+{
+  PriorityInput,
+  PriorityControl,
+  PriorityDisplay,
+  PriorityPersistence,
+  PriorityCount
+};
 
 class ArdunioWorker
 {
@@ -16,21 +28,60 @@ class ArdunioWorker
     {
       ArduinoHandlerParam<unsigned long &> callback;
       unsigned long delay;
+      WorkerPriority priority;
       WorkerList* next;
 
+      // Critical workers (with a max period) have to run at least that often to count as alive.
+      uint8_t id;
+      unsigned long maxPeriod;
+      unsigned long lastRun;
+
       template <typename T>
-      WorkerList(T* obj, void (T::*method)(unsigned long &), WorkerList* n = nullptr)
-        : delay(0)
+      WorkerList(T* obj, void (T::*method)(unsigned long &), WorkerPriority p, unsigned long initialDelay = 0, WorkerList* n = nullptr)
+        : delay(initialDelay)
+        , priority(p)
         , next(n)
+        , id(0)
+        , maxPeriod(0)
+        , lastRun(Clock::Now())
       {
         callback.Register(obj, method);
       };
     };
 
-    ArdunioWorker()
+    // One shot timers come from a fixed pool and are only linked into the active list (sorted by
+    // when they are due) while they are started, so a component without a deadline costs nothing.
+    struct TimerNode
+    {
+      ArduinoHandler callback;
+      unsigned long due;
+      bool active;
+      TimerNode* next;
+    };
+
+    typedef uint8_t TimerHandle;
+
+    static const TimerHandle InvalidTimer = 0xFF;
+
+    // What GetRunningWorker returns between workers.
+    static const uint8_t NoWorker = 0xFF;
+
+    ArdunioWorker(unsigned long passBudgetMicros = _defaultPassBudget)
       : _list(nullptr)
       , _lastRun(0)
+      , _passStarted(false)
+      , _passBudget(passBudgetMicros)
+      , _maxPassMicros(0)
+      , _passHandlerCount(0)
+      , _timerCount(0)
+      , _activeTimers(nullptr)
+      , _workerCount(0)
+      , _runningWorker(NoWorker)
     {
+      for ( uint8_t i = 0; i < PriorityCount; ++i )
+      {
+        _deferrals[i] = 0;
+      }
     }
 
     virtual ~ArdunioWorker()
@@ -43,30 +94,175 @@ class ArdunioWorker
       }
     }
 
+    // The initial delay can be used to stagger workers that would otherwise all run in the
+    // same pass, such as several sensors that each block the loop while they are read.
+    // Giving a max period makes the worker critical, see CheckLiveness.  Workers are numbered in
+    // the order they are added, which is how the watchdog reports them.
     template <typename T>
-    void AddWorker(T* obj, void (T::*method)(unsigned long &))
+    bool AddWorker(T* obj, void (T::*method)(unsigned long &), WorkerPriority priority = PriorityControl, unsigned long initialDelay = 0, unsigned long maxPeriod = 0)
     {
-      WorkerList* newHead = new WorkerList(obj, method, _list);
-      if ( nullptr == newHead )
+      // Keep the list sorted by priority.  Workers with the same priority run in the order they were added.
+      WorkerList** link = &_list;
+      while ( ( nullptr != *link ) && ( (*link)->priority <= priority ) )
+      {
+        link = &(*link)->next;
+      }
+      WorkerList* newItem = new WorkerList(obj, method, priority, initialDelay, *link);
+      if ( nullptr == newItem )
       {
         return false;
       }
-      _list = newHead;
+      newItem->id = _workerCount++;
+      newItem->maxPeriod = maxPeriod;
+      *link = newItem;
+      return true;
+    }
+
+    // Returns false (and which one) if any critical worker hasn't run within its max period.
+    bool CheckLiveness(uint8_t & staleWorker)
+    {
+      unsigned long now = Clock::Now();
+      for ( WorkerList* item = _list; nullptr != item; item = item->next )
+      {
+        if ( item->maxPeriod && ( now - item->lastRun > item->maxPeriod ) )
+        {
+          staleWorker = item->id;
+          return false;
+        }
+      }
       return true;
     }
 
+    // The worker being called right now (or NoWorker), so if one never returns we know which.
+    uint8_t GetRunningWorker()
+    {
+      return _runningWorker;
+    }
+
+    // These handlers are invoked once at the end of every pass, in the order they were added, after
+    // all the workers that were due have run.  This is where work that coalesces the results of the
+    // pass goes (like dispatching events and then rendering).  They can shorten the delay till the next pass.
+    template <typename T>
+    bool AddPassCompleteHandler(T* obj, void (T::*method)(unsigned long &))
+    {
+      if ( _passHandlerCount >= _maxPassHandlers )
+      {
+        return false;
+      }
+      _passHandlers[_passHandlerCount++].Register(obj, method);
+      return true;
+    }
+
+    // Creating a timer just reserves it.  It doesn't do anything till it is started.
+    template <typename T>
+    TimerHandle AddTimer(T* obj, void (T::*method)())
+    {
+      if ( _timerCount >= _maxTimers )
+      {
+        return InvalidTimer;
+      }
+      TimerNode & timer = _timers[_timerCount];
+      timer.callback.Register(obj, method);
+      timer.active = false;
+      timer.next = nullptr;
+      return _timerCount++;
+    }
+
+    // Starting a timer that is already running reschedules it.
+    void StartTimer(TimerHandle handle, unsigned long delay)
+    {
+      if ( handle >= _timerCount )
+      {
+        return;
+      }
+      CancelTimer(handle);
+
+      TimerNode & timer = _timers[handle];
+      timer.due = Clock::Now() + delay;
+      timer.active = true;
+
+      // Keep the list sorted so we only ever have to look at the head to see if anything is due.
+      TimerNode** link = &_activeTimers;
+      while ( ( nullptr != *link ) && ( (long)((*link)->due - timer.due) <= 0 ) )
+      {
+        link = &(*link)->next;
+      }
+      timer.next = *link;
+      *link = &timer;
+    }
+
+    void CancelTimer(TimerHandle handle)
+    {
+      if ( ( handle >= _timerCount ) || !_timers[handle].active )
+      {
+        return;
+      }
+
+      TimerNode & timer = _timers[handle];
+      for ( TimerNode** link = &_activeTimers; nullptr != *link; link = &(*link)->next )
+      {
+        if ( *link == &timer )
+        {
+          *link = timer.next;
+          break;
+        }
+      }
+      timer.active = false;
+      timer.next = nullptr;
+    }
+
+    bool IsTimerActive(TimerHandle handle)
+    {
+      return ( handle < _timerCount ) && _timers[handle].active;
+    }
+
+    // How many times a due worker of the given priority was pushed to the next pass because
+    // the budget was already spent.
+    unsigned long GetDeferrals(WorkerPriority priority)
+    {
+      return _deferrals[priority];
+    }
+
+    // When the current (or last) pass started.
+    unsigned long GetPassTime()
+    {
+      return _lastRun;
+    }
+
+    // The longest any pass has taken to run its workers.
+    unsigned long GetMaxPassMicros()
+    {
+      return _maxPassMicros;
+    }
+
     unsigned long RunWorkers()
     {
-      unsigned long now = millis();
-      unsigned long elapsed = _lastRun ? now - _lastRun : 0;
+      unsigned long start = micros();
+      // Everything run in this pass sees the same time from Clock::Now().
+      Clock::Sample();
+      unsigned long now = Clock::Now();
+      unsigned long elapsed = _passStarted ? now - _lastRun : 0;
+      _passStarted = true;
       _lastRun = now;
       unsigned long next = _maxWait;
       for ( WorkerList* item = _list; nullptr != item; item = item->next )
       {
         if ( elapsed >= item->delay )
         {
-          item->delay = _maxWait;
-          item->callback.Invoke(/*byref*/ item->delay);
+          if ( ( PriorityInput != item->priority ) && ( micros() - start >= _passBudget ) )
+          {
+            // Out of time for this pass, so it will be the first thing due on the next one.
+            ++_deferrals[item->priority];
+            item->delay = 0;
+          }
+          else
+          {
+            item->delay = _maxWait;
+            _runningWorker = item->id;
+            item->callback.Invoke(/*byref*/ item->delay);
+            _runningWorker = NoWorker;
+            item->lastRun = now;
+          }
         }
         else
         {
@@ -77,12 +273,66 @@ class ArdunioWorker
           next = item->delay;
         }
       }
+      unsigned long passMicros = micros() - start;
+      if ( passMicros > _maxPassMicros )
+      {
+        _maxPassMicros = passMicros;
+      }
+
+      RunTimers(now, /*byref*/ next);
+      for ( uint8_t i = 0; i < _passHandlerCount; ++i )
+      {
+        _passHandlers[i].Invoke(/*byref*/ next);
+      }
       return next;
     }
 
+  private:
+
+    void RunTimers(unsigned long now, unsigned long & next)
+    {
+      // A timer is taken off the list before it is called back so it can start itself again.
+      // We limit how many fire per pass so one that keeps restarting with no delay can't stall us.
+      for ( uint8_t fired = 0; ( fired < _maxTimers ) && ( nullptr != _activeTimers ) && Clock::Reached(now, _activeTimers->due); ++fired )
+      {
+        TimerNode* timer = _activeTimers;
+        _activeTimers = timer->next;
+        timer->active = false;
+        timer->next = nullptr;
+        timer->callback.Invoke();
+      }
+
+      if ( nullptr != _activeTimers )
+      {
+        long untilDue = (long)(_activeTimers->due - now);
+        if ( untilDue <= 0 )
+        {
+          next = 0;
+        }
+        else if ( (unsigned long)untilDue < next )
+        {
+          next = untilDue;
+        }
+      }
+    }
+
   private:
     static const unsigned long _maxWait = 0xFFFFFFFF;
+    static const uint8_t _maxPassHandlers = 4;
+    static const uint8_t _maxTimers = 8;
+    static const unsigned long _defaultPassBudget = 5 /*ms*/ * 1000;
     WorkerList* _list;
     unsigned long _lastRun;
+    bool _passStarted;
+    const unsigned long _passBudget;
+    unsigned long _maxPassMicros;
+    unsigned long _deferrals[PriorityCount];
+    ArduinoHandlerParam<unsigned long &> _passHandlers[_maxPassHandlers];
+    uint8_t _passHandlerCount;
+    TimerNode _timers[_maxTimers];
+    uint8_t _timerCount;
+    TimerNode* _activeTimers;
+    uint8_t _workerCount;
+    volatile uint8_t _runningWorker;
 };
 
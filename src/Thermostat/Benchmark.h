@@ -0,0 +1,215 @@
+#pragma once
+
+#include "ArduinoWorker.h"
+#include "ArduinoHandler.h"
+#include "DisplaySegments.h"
+#include "ButtonPress.h"
+#include "Thermostat.h"
+#include "SimulatedSensor.h"
+
+// Counting the allocations takes our own operator new, which would clash with the one in the
+// Arduino core, so only the host build counts them (see src/Host/bench.cpp).
+#ifdef BENCHMARK_ALLOCATIONS
+extern unsigned long benchmarkAllocations;
+#endif
+
+// Times the building blocks everything else is made from, on the board itself so the numbers
+// include the real cost of the hardware (like the display bus).  The results are written as a
+// single line of JSON so they can be captured from the serial port and compared between commits.
+// The allocations per op are only there when they are counted.
+//
+// A single short run is thrown off by whatever else happens to be going on (interrupts on the
+// board, the rest of the PC), so after a warm up each op is run over and over for at least
+// 100ms, a few times over.  The time reported is the median of those runs, with the fastest
+// alongside it, which is about as steady as the op itself gets.
+class Benchmark
+{
+  public:
+
+    Benchmark(Print & out)
+      : _out(out)
+      , _first(true)
+    {
+    }
+
+    void RunAll(int pinClk, int pinDio, int pinButton)
+    {
+      _out.print(F("{\"benchmarks\":["));
+      RunWorkers();
+      RunHandlers();
+      RunDisplay(pinClk, pinDio);
+      RunButton(pinButton);
+      RunConversions();
+      _out.println(F("]}"));
+    }
+
+  private:
+
+    struct Noop
+    {
+      void Work(unsigned long & delay)
+      {
+        // Always due so every pass runs every worker.
+        delay = 0;
+      }
+
+      void Call(int param)
+      {
+        sink = param;
+      }
+    };
+
+    void RunWorkers()
+    {
+      static const uint8_t workerCounts[] PROGMEM = { 1, 2, 4, 8, 16 };
+      Noop noop;
+      for ( uint8_t i = 0; i < sizeof(workerCounts); ++i )
+      {
+        ArdunioWorker worker;
+        uint8_t workerCount = pgm_read_byte(&workerCounts[i]);
+        for ( uint8_t count = 0; count < workerCount; ++count )
+        {
+          worker.AddWorker(&noop, &Noop::Work);
+        }
+        Measure(F("ArdunioWorker::RunWorkers"), workerCount, _iterations, [&]() { sink = worker.RunWorkers(); });
+      }
+    }
+
+    void RunHandlers()
+    {
+      Noop noop;
+      ArduinoHandlerParam<int> handler;
+      handler.Register(&noop, &Noop::Call);
+      Measure(F("ArduinoHandlerParam::Invoke"), 1, _iterations, [&]() { handler.Invoke(1); });
+    }
+
+    void RunDisplay(int pinClk, int pinDio)
+    {
+      static const char text[] PROGMEM = "0123456789-_abcdefghijklmnopqrstuvwxyz";
+      static const uint8_t textLengths[] PROGMEM = { 1, 4, 16, sizeof(text) - 1 };
+      DisplaySegments display(pinClk, pinDio);
+
+      for ( uint8_t i = 0; i < sizeof(textLengths); ++i )
+      {
+        uint8_t length = pgm_read_byte(&textLengths[i]);
+        Measure(F("DisplaySegments::_getSegments"), length, _iterations / length, [&]()
+        {
+          for ( uint8_t c = 0; c < length; ++c )
+          {
+            sink = display._getSegments(pgm_read_byte(&text[c]));
+          }
+        });
+      }
+
+      Measure(F("DisplaySegments::showText"), 4, _iterations, [&]() { display.showText((const __FlashStringHelper *)text); });
+
+      // Sending is dominated by the bus, so it doesn't need as many runs.  The text has to
+      // change each time or there would be nothing to send.
+      bool other = false;
+      Measure(F("DisplaySegments::Flush"), 4, _iterations / 20, [&]()
+      {
+        display.showText((const __FlashStringHelper *)(other ? text + 4 : text));
+        display.Flush();
+        other = !other;
+      });
+      display.clear();
+      display.Flush();
+    }
+
+    void RunButton(int pinButton)
+    {
+      ButtonPress button(pinButton);
+      unsigned long delay;
+      Measure(F("ButtonPress::CheckButton"), 1, _iterations, [&]() { button.CheckButton(delay); });
+    }
+
+    void RunConversions()
+    {
+      SimulatedSensor sensor(25);
+      PersistedData storage;
+      EventBus bus;
+      Thermostat thermostat(&sensor, &storage, &bus);
+      unsigned long delay;
+      thermostat.RefreshTemp(delay);
+
+      Measure(F("Thermostat::ConvertCtoF"), 1, _iterations, [&]() { sink = thermostat.GetCurrentTemp(false); });
+      Measure(F("Thermostat::ConvertFtoC"), 1, _iterations, [&]() { sink = thermostat.GetTriggerTemp(true); });
+    }
+
+    // The op is run in batches of the given iterations, so reading the clock doesn't add to it.
+    template <typename T_OP>
+    void Measure(const __FlashStringHelper * name, int param, unsigned long iterations, T_OP op)
+    {
+      RunBatch(iterations, op);
+
+#ifdef BENCHMARK_ALLOCATIONS
+      unsigned long allocations = benchmarkAllocations;
+#endif
+      unsigned long totalOps = 0;
+      float nsPerOp[_repetitions];
+      for ( uint8_t repetition = 0; repetition < _repetitions; ++repetition )
+      {
+        unsigned long ops = 0;
+        unsigned long start = micros();
+        unsigned long elapsed;
+        do
+        {
+          RunBatch(iterations, op);
+          ops += iterations;
+          elapsed = micros() - start;
+        }
+        while ( elapsed < _minRunMicros );
+        totalOps += ops;
+
+        // Kept in order as they come in, there are only a few.
+        float time = elapsed * 1000.0 / ops;
+        uint8_t i = repetition;
+        for ( ; ( i > 0 ) && ( nsPerOp[i - 1] > time ); --i )
+        {
+          nsPerOp[i] = nsPerOp[i - 1];
+        }
+        nsPerOp[i] = time;
+      }
+
+      if ( !_first )
+      {
+        _out.print(',');
+      }
+      _first = false;
+      _out.print(F("{\"name\":\""));
+      _out.print(name);
+      _out.print(F("\",\"param\":"));
+      _out.print(param);
+      _out.print(F(",\"ns_per_op\":"));
+      _out.print(nsPerOp[_repetitions / 2], 1);
+      _out.print(F(",\"min_ns_per_op\":"));
+      _out.print(nsPerOp[0], 1);
+#ifdef BENCHMARK_ALLOCATIONS
+      _out.print(F(",\"allocs_per_op\":"));
+      _out.print((float)(benchmarkAllocations - allocations) / totalOps, 3);
+#endif
+      _out.print('}');
+    }
+
+    template <typename T_OP>
+    static void RunBatch(unsigned long iterations, T_OP & op)
+    {
+      for ( unsigned long i = 0; i < iterations; ++i )
+      {
+        op();
+      }
+    }
+
+  private:
+
+    static const unsigned long _iterations = 1000;
+    static const uint8_t _repetitions = 5;
+    static const unsigned long _minRunMicros = 100 /*ms*/ * 1000UL;
+
+    static volatile long sink;
+
+    Print & _out;
+    bool _first;
+};
+
+volatile long Benchmark::sink = 0;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ArduinoHandler.h"
+#include "Clock.h"
 
 class ButtonPress
 {
@@ -9,10 +10,21 @@ class ButtonPress
     ButtonPress(int pinButton)
       : _pin(pinButton)
       , _longPressTime(0)
+      , _repeatDelay(0)
+      , _repeatInterval(0)
+      , _nextRepeat(0)
       , _pressTimeStamp(0)
       , _changeTimeStamp(0)
+      , _changeMicros(0)
+      , _handlerMicros(0)
       , _pressedLastTime(false)
+      , _pressStarted(false)
       , _pressHandled(false)
+      , _repeatAsked(false)
+      , _repeating(false)
+      , _simulated(false)
+      , _simulatedPressed(false)
+      , _simulatedEdge(0)
     {
       pinMode(pinButton, INPUT_PULLUP);
     }
@@ -35,23 +47,95 @@ class ButtonPress
       _longPressTime = pressMS;
     }
 
+    // Called as soon as the button is down (once it has settled).  If the handler sets the flag,
+    // nothing else happens for this press.
+    template <typename T>
+    void RegisterPressHandler(T* obj, void (T::*method)(bool &))
+    {
+      _handlerPress.Register(obj, method);
+    }
+
+    // Once the button has been held for the delay, this is called over and over (faster each time)
+    // till it is let go.  The handler sets the flag if it did something with the hold.  If it doesn't
+    // the first time, the hold is left for the long press, so the same button can do both depending
+    // on what the handler is up to.
+    template <typename T>
+    void RegisterRepeatHandler(T* obj, void (T::*method)(bool &), unsigned long delayMS)
+    {
+      _handlerRepeat.Register(obj, method);
+      _repeatDelay = delayMS;
+    }
+
+    // Called with every raw change in the button state, before any debouncing.
+    template <typename T>
+    void RegisterEdgeHandler(T* obj, void (T::*method)(const ButtonPress &))
+    {
+      _handlerEdge.Register(obj, method);
+    }
+
+    // Called right after each (debounced) press and short press has been handled, so how long the
+    // input took to get there can be timed.  The long press and repeats aren't included, since
+    // they wait for the hold on purpose.
+    template <typename T>
+    void RegisterHandledHandler(T* obj, void (T::*method)(const ButtonPress &))
+    {
+      _handlerHandled.Register(obj, method);
+    }
+
     void CheckButton(unsigned long & delay)
     {
       delay = CheckButtonPress();
     }
 
+    int GetPin() const
+    {
+      return _pin;
+    }
+
+    // The raw state as of the last check.
+    bool IsPressed() const
+    {
+      return _pressedLastTime;
+    }
+
+    // When (in us) the button last actually changed.  We only see that at the next check, unless
+    // it is simulated and we're told right when it happens.
+    unsigned long GetEdgeMicros() const
+    {
+      return _simulated ? _simulatedEdge : _changeMicros;
+    }
+
+    // How long the last press or short press handler took to run.
+    unsigned long GetHandlerMicros() const
+    {
+      return _handlerMicros;
+    }
+
+    // From now on the button is in whatever state is set here rather than what is read from the pin.
+    void SetSimulatedState(bool pressed)
+    {
+      if ( !_simulated || ( pressed != _simulatedPressed ) )
+      {
+        _simulatedEdge = Clock::Micros();
+      }
+      _simulated = true;
+      _simulatedPressed = pressed;
+    }
+
   private:
 
     unsigned long CheckButtonPress()
     {
-      bool pressed = (digitalRead(_pin) == LOW);
-      unsigned long now = millis();
+      bool pressed = _simulated ? _simulatedPressed : (digitalRead(_pin) == LOW);
+      unsigned long now = Clock::Now();
 
       // We want to make sure we get the same state a few checks in a row before we act on it.
       if ( pressed != _pressedLastTime )
       {
         _pressedLastTime = pressed;
         _changeTimeStamp = now;
+        _changeMicros = Clock::Micros();
+        _handlerEdge.Invoke(*this);
         return _minChangeTime;
       }
 
@@ -67,21 +151,52 @@ class ButtonPress
       if ( pressed )
       {
         // We're we previously in a pressed state.
-        if ( 0 == _pressTimeStamp )
+        if ( !_pressStarted )
         {
-          // Button in the pressed for the first time since we don't have a timestamp.
-          // Just capture this and return.
+          // Button in the pressed for the first time, so capture when it started and return.
+          // We keep a separate flag rather than using 0 as "no timestamp" since 0 is a perfectly
+          // good time, both right after boot and every time millis() wraps.
+          _pressStarted = true;
           _pressTimeStamp = _changeTimeStamp;
-          _pressHandled = false;  // This should already be in this state, but just to be sure.
+          _repeatAsked = false;
+          _repeating = false;
+          bool handled = false;
+          unsigned long start = Clock::Micros();
+          _handlerPress.Invoke(handled);
+          _handlerMicros = Clock::Micros() - start;
+          _handlerHandled.Invoke(*this);
+          _pressHandled = handled;
           return _minChangeTime;
         }
 
+        if ( _repeating )
+        {
+          return Repeat(now);
+        }
+
         // We may have already handled the long press.  If so, we won't do anything until the state changes.
         if ( _pressHandled )
         {
           return _minChangeTime;
         }
-        
+
+        // See if the hold is for repeating, but only ask the once per press.
+        if ( _handlerRepeat.HasHandler() && !_repeatAsked && ( now - _pressTimeStamp >= _repeatDelay ) )
+        {
+          _repeatAsked = true;
+          bool repeated = false;
+          _handlerRepeat.Invoke(repeated);
+          if ( repeated )
+          {
+            // Nothing else happens for this press, not even when it is let go.
+            _repeating = true;
+            _pressHandled = true;
+            _repeatInterval = _firstRepeatInterval;
+            _nextRepeat = now + _repeatInterval;
+            return _minChangeTime;
+          }
+        }
+
         // We only need to check for long press if there is a handler for it.
         if ( _handlerLongPress.HasHandler() )
         {
@@ -104,7 +219,7 @@ class ButtonPress
       }
 
       // Button isn't pressed and if it wasn't pressed previously, there is nothing to do.
-      if ( 0 == _pressTimeStamp )
+      if ( !_pressStarted )
       {
         _pressHandled = false;  // This should already be in this state, but just to be sure.
         return _minChangeTime;
@@ -114,17 +229,44 @@ class ButtonPress
       // and return since it was already handled and we were just waiting for the button to release.
       if ( _pressHandled )
       {
-        _pressTimeStamp = 0;
+        _pressStarted = false;
         _pressHandled = false;
+        _repeating = false;
         return _minChangeTime;
       }
 
       // This should be a short press.  We've already ensured that it was in this state for the min
       // time at the top, so just do it already.
-      _pressTimeStamp = 0;
+      _pressStarted = false;
+      unsigned long start = Clock::Micros();
       _handlerShortPress.Invoke();
+      _handlerMicros = Clock::Micros() - start;
+      _handlerHandled.Invoke(*this);
       return _minChangeTime;
     }
+
+    // Each repeat comes a quarter sooner than the last, down to the min interval, so a small
+    // change is still easy to stop on.  Past that the handler has to take bigger steps itself
+    // for a big change to go any quicker (like HeatDisplay does).
+    unsigned long Repeat(unsigned long now)
+    {
+      if ( Clock::Reached(now, _nextRepeat) )
+      {
+        bool repeated = false;
+        _handlerRepeat.Invoke(repeated);
+        _repeatInterval = _repeatInterval * 3 / 4;
+        if ( _repeatInterval < _minRepeatInterval )
+        {
+          _repeatInterval = _minRepeatInterval;
+        }
+        _nextRepeat = now + _repeatInterval;
+      }
+
+      // We still have to keep checking as often as usual, or a quick let go and press again
+      // between two slow repeats would be missed (and the new press taken for this one).
+      unsigned long untilRepeat = _nextRepeat - now;
+      return untilRepeat < _minChangeTime ? untilRepeat : _minChangeTime;
+    }
  
   private:
 
@@ -133,15 +275,36 @@ class ButtonPress
     // be called to check our state.  We may have to make that frequency shorter than minimum button press if we see issues.
     static const unsigned long _minChangeTime = 50 /*ms*/;
 
+    static const unsigned long _firstRepeatInterval = 150 /*ms*/;
+    // Any faster and the display (which is only redrawn a bit at a time) and the user's eye can't
+    // keep up, so they'd overshoot the setting they wanted to stop on.
+    static const unsigned long _minRepeatInterval = 60 /*ms*/;
+
     const int _pin;
 
     ArduinoHandler _handlerShortPress;
     ArduinoHandler _handlerLongPress;
+    ArduinoHandlerParam<bool &> _handlerPress;
+    ArduinoHandlerParam<bool &> _handlerRepeat;
+    ArduinoHandlerParam<const ButtonPress &> _handlerEdge;
+    ArduinoHandlerParam<const ButtonPress &> _handlerHandled;
     unsigned long _longPressTime;
+    unsigned long _repeatDelay;
+    unsigned long _repeatInterval;
+    unsigned long _nextRepeat;
 
     unsigned long _pressTimeStamp;
     unsigned long _changeTimeStamp;
+    unsigned long _changeMicros;
+    unsigned long _handlerMicros;
     bool _pressedLastTime;
+    bool _pressStarted;
     bool _pressHandled;
+    bool _repeatAsked;
+    bool _repeating;
+
+    bool _simulated;
+    bool _simulatedPressed;
+    unsigned long _simulatedEdge;
 };
 
@@ -0,0 +1,130 @@
+#pragma once
+
+// Everything that needs the time gets it from here rather than calling millis() directly.
+// Normally this is just millis(), but a trace replay can switch it to a virtual clock that
+// only moves when told to, so hours of recorded input can be run through in moments.
+//
+// The worker samples the time once at the start of every pass, and everything run in the pass
+// uses that same time from Now().  So the components all agree on the time within a pass, and
+// millis() (which has to turn interrupts off to read) is only read the once.  Now64() is the same
+// time extended to 64 bits, so it never wraps.  The 32 bit times do wrap (every 49 days), so they
+// should only ever be subtracted (to get how long since) or compared with Reached().
+//
+// Micros() is the time right now to the us, for timing things that are over in less than a ms.
+// On the virtual clock it carries on from where the clock was set by however long the code has
+// run since (and anything it blocked on), so the ms and the us are still the one clock.
+//
+// On the PC a program can run a whole fleet of units, each on its own thread with its own clock,
+// by defining UNIT_LOCAL as thread_local before including this.
+#ifndef UNIT_LOCAL
+#define UNIT_LOCAL
+#endif
+
+class Clock
+{
+  public:
+
+    // Called by the worker at the start of each pass.
+    static void Sample()
+    {
+      unsigned long sample = Millis();
+
+      // The 64 bit time only moves forward.  Any step back (like switching to the virtual clock)
+      // is just ignored, while a wrap of the 32 bit time is a small step forward like any other.
+      long step = (long)(sample - _sample);
+      if ( step > 0 )
+      {
+        _now64 += step;
+      }
+      _sample = sample;
+    }
+
+    // The time the current (or last) pass started.
+    static unsigned long Now()
+    {
+      return (unsigned long)_now64 + _shift;
+    }
+
+    static uint64_t Now64()
+    {
+      return _now64;
+    }
+
+    // Whether the deadline has come, even if the time has wrapped in between (as long as they
+    // are within 24 days of each other).
+    static bool Reached(unsigned long now, unsigned long deadline)
+    {
+      return (long)(now - deadline) >= 0;
+    }
+
+    // Reads the time right now, rather than when the pass started.  Only needed outside passes.
+    static unsigned long Millis()
+    {
+      return _virtual ? (unsigned long)(VirtualMicros() / 1000) : millis();
+    }
+
+    static unsigned long Micros()
+    {
+      return _virtual ? (unsigned long)VirtualMicros() : micros();
+    }
+
+    static bool IsVirtual()
+    {
+      return _virtual;
+    }
+
+    // Switches to the virtual clock (if we weren't already) and sets its time.
+    static void SetVirtual(unsigned long ms)
+    {
+      SetVirtualMicros((uint64_t)ms * 1000);
+    }
+
+    static void SetVirtualMicros(uint64_t us)
+    {
+      _virtual = true;
+      _virtualMicros = us;
+      _virtualSince = micros();
+    }
+
+    // The virtual time, including however long has been spent since it was set.
+    static uint64_t VirtualMicros()
+    {
+      return _virtualMicros + (unsigned long)(micros() - _virtualSince);
+    }
+
+    // Moves the time from Now() (but not Now64()) on so that it wraps in the given ms.  On the
+    // board that happens by itself every 49 days, but on the PC an unsigned long is 64 bits and
+    // never would, so this is how a check there gets the code to go through a wrap.
+    static void WrapIn(unsigned long ms)
+    {
+      _shift = 0 - ms - (unsigned long)_now64;
+    }
+
+    // Back to how it was at boot, for when the same thread goes on to run another unit.
+    static void Reset()
+    {
+      _shift = 0;
+      _virtual = false;
+      _virtualMicros = 0;
+      _virtualSince = 0;
+      _sample = 0;
+      _now64 = 0;
+    }
+
+  private:
+
+    static UNIT_LOCAL bool _virtual;
+    static UNIT_LOCAL uint64_t _virtualMicros;
+    static UNIT_LOCAL unsigned long _virtualSince;
+    static UNIT_LOCAL unsigned long _sample;
+    static UNIT_LOCAL uint64_t _now64;
+    static UNIT_LOCAL unsigned long _shift;
+};
+
+// Like the rest of the headers, this is only meant to be included by the single sketch file.
+UNIT_LOCAL bool Clock::_virtual = false;
+UNIT_LOCAL uint64_t Clock::_virtualMicros = 0;
+UNIT_LOCAL unsigned long Clock::_virtualSince = 0;
+UNIT_LOCAL unsigned long Clock::_sample = 0;
+UNIT_LOCAL uint64_t Clock::_now64 = 0;
+UNIT_LOCAL unsigned long Clock::_shift = 0;
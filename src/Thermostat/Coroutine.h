@@ -0,0 +1,97 @@
+#pragma once
+
+#include "ArduinoWorker.h"
+
+// Stackless coroutines (protothreads) that run on one of the worker's one shot timers.  A derived
+// class puts its sequence in Run() between CO_BEGIN() and CO_END() and can yield with the await
+// macros below.  This lets multi-step sequences be written top to bottom without ever blocking
+// the loop.  The whole state is the line to resume at, the timer and a flag (plus the vtable).
+//
+// Since there is no stack, local variables don't survive an await.  Anything that needs to be
+// kept across one (like a loop counter) has to be a member of the derived class.
+// Also, the await macros can't be used inside a switch statement of their own.
+class Coroutine
+{
+  public:
+
+    Coroutine()
+      : _worker(nullptr)
+      , _resumeLine(0)
+      , _timer(ArdunioWorker::InvalidTimer)
+      , _waitingForSignal(false)
+    {
+    }
+
+    virtual ~Coroutine()
+    {
+    }
+
+    // (Re)starts the sequence from the top on the next worker pass.
+    void Start(ArdunioWorker * worker)
+    {
+      if ( ArdunioWorker::InvalidTimer == _timer )
+      {
+        _worker = worker;
+        _timer = _worker->AddTimer(this, &Coroutine::Run);
+      }
+      _resumeLine = 0;
+      _waitingForSignal = false;
+      _worker->StartTimer(_timer, 0);
+    }
+
+    void Stop()
+    {
+      if ( _worker )
+      {
+        _worker->CancelTimer(_timer);
+      }
+      _resumeLine = 0;
+      _waitingForSignal = false;
+    }
+
+    bool IsRunning()
+    {
+      return _waitingForSignal || ( _worker && _worker->IsTimerActive(_timer) );
+    }
+
+    // Wakes the coroutine up if it is waiting in CO_AWAIT_SIGNAL().
+    void Signal()
+    {
+      if ( _waitingForSignal )
+      {
+        _waitingForSignal = false;
+        _worker->StartTimer(_timer, 0);
+      }
+    }
+
+  protected:
+
+    virtual void Run() = 0;
+
+    void ResumeAfter(unsigned long ms)
+    {
+      _worker->StartTimer(_timer, ms);
+    }
+
+    void ResumeOnSignal()
+    {
+      _waitingForSignal = true;
+    }
+
+  protected:
+
+    ArdunioWorker * _worker;
+    uint16_t _resumeLine;
+
+  private:
+
+    ArdunioWorker::TimerHandle _timer;
+    bool _waitingForSignal;
+};
+
+// Each await records the line it is on and returns.  When the timer resumes us, the switch jumps
+// straight back into the middle of the sequence at that line.
+#define CO_BEGIN()            switch ( _resumeLine ) { case 0:
+#define CO_AWAIT_MS(ms)       do { _resumeLine = __LINE__; ResumeAfter(ms); return; case __LINE__: ; } while ( 0 )
+#define CO_AWAIT_SIGNAL()     do { _resumeLine = __LINE__; ResumeOnSignal(); return; case __LINE__: ; } while ( 0 )
+#define CO_END()              } _resumeLine = 0
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <DHT11.h>  // https://github.com/dhrubasaha08/DHT11
+#include "TempSensor.h"
+
+class DHT11Sensor : public TempSensor
+{
+  public:
+
+    DHT11Sensor(int pinSensor)
+      : _dht11(pinSensor)
+    {
+    }
+
+    virtual unsigned long StartConversion()
+    {
+      // The DHT11 does its conversion as part of the read transaction, so there is nothing to wait for.
+      return 0;
+    }
+
+    virtual bool PollResult(int & tempCelsius, unsigned long & delay)
+    {
+      // This is a single bit-banged transaction that takes a few dozen ms.
+      int temp = _dht11.readTemperature();
+      if ( temp == DHT11::ERROR_CHECKSUM )
+      {
+        tempCelsius = ERROR_CHECKSUM;
+      }
+      else if ( temp >= DHT11::ERROR_TIMEOUT )
+      {
+        tempCelsius = ERROR_TIMEOUT;
+      }
+      else
+      {
+        tempCelsius = temp;
+      }
+      return true;
+    }
+
+    virtual unsigned long GetMinInterval()
+    {
+      // The data sheet says it can't be read more than once a second.
+      return 1 /*second*/ * 1000;
+    }
+
+  private:
+
+    DHT11 _dht11;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <OneWire.h>  // https://github.com/PaulStoffregen/OneWire
+#include "TempSensor.h"
+#include "Clock.h"
+
+// Reads a single DS18B20 on its own 1-Wire bus (so we can skip addressing it) with external power.
+class DS18B20Sensor : public TempSensor
+{
+  public:
+
+    DS18B20Sensor(int pinSensor)
+      : _oneWire(pinSensor)
+      , _started(0)
+    {
+    }
+
+    virtual unsigned long StartConversion()
+    {
+      if ( !_oneWire.reset() )
+      {
+        // Nothing answered, so let the poll report it right away.
+        return 0;
+      }
+      _oneWire.skip();
+      _oneWire.write(CMD_CONVERT);
+      _started = Clock::Now();
+      return _conversionTime;
+    }
+
+    virtual bool PollResult(int & tempCelsius, unsigned long & delay)
+    {
+      // The sensor holds the bus low until the conversion is done.  The data sheet time is the
+      // worst case, so this usually succeeds on the first poll.
+      // If it never lets go (a shorted line or a stuck sensor) we'd poll forever and the thermostat
+      // would never hear about it, so give up once it is well past that.
+      if ( !_oneWire.read_bit() )
+      {
+        if ( Clock::Now() - _started >= _conversionTime + _timeoutMargin )
+        {
+          tempCelsius = ERROR_TIMEOUT;
+          return true;
+        }
+        delay = _pollInterval;
+        return false;
+      }
+
+      if ( !_oneWire.reset() )
+      {
+        tempCelsius = ERROR_TIMEOUT;
+        return true;
+      }
+      _oneWire.skip();
+      _oneWire.write(CMD_READ_SCRATCHPAD);
+
+      uint8_t scratchpad[9];
+      _oneWire.read_bytes(scratchpad, sizeof(scratchpad));
+      if ( OneWire::crc8(scratchpad, 8) != scratchpad[8] )
+      {
+        tempCelsius = ERROR_CHECKSUM;
+        return true;
+      }
+
+      // The raw reading is in 1/16 degree, so round it to the nearest whole degree.
+      int16_t raw = (int16_t)((scratchpad[1] << 8) | scratchpad[0]);
+      if ( _powerOnRaw == raw )
+      {
+        // This is what the scratchpad holds at power on, so the sensor reset (like on a brown out)
+        // and never did the conversion.  A room is never really at 85C.
+        tempCelsius = ERROR_TIMEOUT;
+        return true;
+      }
+      tempCelsius = (raw + 8) >> 4;
+      return true;
+    }
+
+  private:
+
+    static const uint8_t CMD_CONVERT = 0x44;
+    static const uint8_t CMD_READ_SCRATCHPAD = 0xBE;
+
+    // Worst case time for a 12 bit conversion.
+    static const unsigned long _conversionTime = 750 /*ms*/;
+    static const unsigned long _pollInterval = 10 /*ms*/;
+    static const unsigned long _timeoutMargin = 250 /*ms*/;
+
+    // 85C, which the scratchpad holds till the first conversion is done.
+    static const int16_t _powerOnRaw = 0x0550;
+
+    OneWire _oneWire;
+    unsigned long _started;
+};
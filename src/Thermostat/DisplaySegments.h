@@ -1,14 +1,43 @@
 #pragma once
 
-#include <TM1637Display.h>  // https://github.com/avishorp/TM1637
+#include <TM1637Display.h>  // https://github.com/avishorp/TM1637 (only for the segment names)
+#include "Clock.h"
 
+// Draws into a frame in RAM and clocks it out to the TM1637 in the background, one edge of the
+// bus per call to Transmit().  The library sends a whole update at once with delays between every
+// edge, which holds up the loop for several ms (and we used to do that a few times per repaint).
+// Here the show functions only change the frame, and the frame and brightness are only sent when
+// they have changed, so a repaint that ends up the same costs no bus time at all.
 class DisplaySegments
 {
   public:
     DisplaySegments(int pinClk, int pinDio)
-      : _display(pinClk, pinDio)
-      
-    {}
+      : _pinClk(pinClk)
+      , _pinDio(pinDio)
+      , _control(_cmdControl | LedMax | _controlOn)
+      , _framePending(true)
+      , _controlPending(true)
+      , _txStep(StepIdle)
+      , _txLength(0)
+      , _txEnds(0)
+      , _txByte(0)
+      , _txBit(0)
+      , _lastEdge(0)
+      , _bytesSent(0)
+      , _framesSent(0)
+      , _transmitMicros(0)
+      , _changes(0)
+      , _txChanges(0)
+      , _changesShown(0)
+      , _busless(false)
+    {
+      // Both lines are only ever pulled low (by driving them) or let go to float high.
+      pinMode(_pinClk, INPUT);
+      pinMode(_pinDio, INPUT);
+      digitalWrite(_pinClk, LOW);
+      digitalWrite(_pinDio, LOW);
+      memset(_frame, 0, sizeof(_frame));
+    }
 
     // Declare an enum so the functions with overloads to take multiple argments can
     // tell the difference from a letter vs the optional position to begin the text.
@@ -32,11 +61,6 @@ class DisplaySegments
 
     static const char Degree = 0xB0;
 
-    TM1637Display& TM1637()
-    {
-      return _display;
-    };
-
     bool showChar(char c, Position pos = Position::PosFirst)
     {
       bool ret = true;
@@ -45,11 +69,11 @@ class DisplaySegments
       {
         ret = false;
       }
-      _display.setSegments(&segments, 1, pos);
+      setSegments(&segments, 1, pos);
       return ret;
     }
 
-    bool showText(char * text, Position pos = Position::PosFirst)
+    bool showText(const char * text, Position pos = Position::PosFirst)
     {
       bool ret = true;
       uint8_t displaySegments[_digits];
@@ -62,11 +86,21 @@ class DisplaySegments
           ret = false;
         }
       }
-      _display.setSegments(displaySegments + pos, _digits - pos, pos);
+      setSegments(displaySegments + pos, _digits - pos, pos);
       return ret;
     }
 
-    bool scrollText(char * text, unsigned long msDelay)
+    // Same as above, but for text kept in flash with F("...").  Only as much as will fit on
+    // the display is ever copied into RAM.
+    bool showText(const __FlashStringHelper * text, Position pos = Position::PosFirst)
+    {
+      char buffer[_digits + 1];
+      strncpy_P(buffer, (PGM_P)text, _digits - pos);
+      buffer[_digits - pos] = '\0';
+      return showText(buffer, pos);
+    }
+
+    bool scrollText(const char * text, unsigned long msDelay)
     {
       bool ret = true;
       for ( Position pos = Position::PosForth; pos > Position::PosFirst; pos = pos - 1 )
@@ -75,41 +109,359 @@ class DisplaySegments
         {
           ret = false;
         }
+        Flush();
         delay(msDelay);
       }
-      for ( char * remainder = text; *remainder; ++remainder )
+      for ( const char * remainder = text; *remainder; ++remainder )
       {
         if ( !showText(remainder) )
         {
           ret = false;
         }
+        Flush();
         delay(msDelay);
       }
-      _display.clear();
+      clear();
+      Flush();
+      return ret;
+    }
+
+    bool scrollText(const __FlashStringHelper * text, unsigned long msDelay)
+    {
+      bool ret = true;
+      for ( Position pos = Position::PosForth; pos > Position::PosFirst; pos = pos - 1 )
+      {
+        if ( !showText(text, pos) )
+        {
+          ret = false;
+        }
+        Flush();
+        delay(msDelay);
+      }
+      for ( PGM_P remainder = (PGM_P)text; pgm_read_byte(remainder); ++remainder )
+      {
+        if ( !showText((const __FlashStringHelper *)remainder) )
+        {
+          ret = false;
+        }
+        Flush();
+        delay(msDelay);
+      }
+      clear();
+      Flush();
       return ret;
     }
 
     void showNumberDec(int num, bool leading_zero = false, uint8_t length = 4, Position pos = Position::PosFirst)
     {
-      _display.showNumberDec(num, leading_zero, length, pos);
+      // Right aligned like the library, with a minus just before the first digit.
+      uint8_t segments[_digits];
+      bool negative = ( num < 0 );
+      // Negated as unsigned, so even the most negative int comes out right.
+      unsigned int value = negative ? 0U - (unsigned int)num : num;
+      // The leading zeros go all the way to the first digit, so the minus has to go there first.
+      int8_t first = 0;
+      if ( negative && leading_zero && length )
+      {
+        segments[0] = Segments_dash;
+        first = 1;
+      }
+      for ( int8_t i = length - 1; i >= first; --i )
+      {
+        if ( value || leading_zero || ( length - 1 == i ) )
+        {
+          segments[i] = _getSegments('0' + value % 10);
+        }
+        else if ( negative )
+        {
+          segments[i] = Segments_dash;
+          negative = false;
+        }
+        else
+        {
+          segments[i] = Segments_space;
+        }
+        value /= 10;
+      }
+      setSegments(segments, length, pos);
     }
 
     void setBrightness(Brightness brightness, bool on = true)
     {
-      _display.setBrightness(brightness, on);
+      // While it is off the brightness doesn't show, so it is left as it was.  Then changes to
+      // it meanwhile (like the ambient light) don't send anything till it comes back on.
+      uint8_t control = on ? ( _cmdControl | brightness | _controlOn ) : ( _control & ~_controlOn );
+      if ( control != _control )
+      {
+        _control = control;
+        _controlPending = true;
+        ++_changes;
+      }
     }
 
     void clear()
     {
-      _display.clear();
+      uint8_t segments[_digits] = { 0 };
+      setSegments(segments, _digits);
+    }
+
+    // Called at the end of every pass.  Sends the edges of whatever is being sent for up to a ms,
+    // then lets the next pass run and keeps the passes coming till it is all out.
+    //
+    // The chip needs the gap between edges, so a frame is on the bus for about 20ms whatever we
+    // do.  Sending one edge a pass handed each 100us gap back to the loop, but all it did with
+    // them was spin through hundreds of passes with nothing due.  So we wait out the gaps here
+    // instead, but only for a ms at a time, so a button or sensor never waits behind a whole
+    // frame.  Either way the CPU is busy while a frame goes out, which is fine since there is
+    // nothing else for it to do in the meantime (and the frames only go out when it changes).
+    void Transmit(unsigned long & delay)
+    {
+      if ( _busless )
+      {
+        SkipBus();
+        return;
+      }
+      if ( !IsBusy() && !Load() )
+      {
+        return;
+      }
+      unsigned long start = Clock::Micros();
+      do
+      {
+        unsigned long sinceEdge = Clock::Micros() - _lastEdge;
+        if ( sinceEdge < _edgeMicros )
+        {
+          delayMicroseconds(_edgeMicros - sinceEdge);
+        }
+        unsigned long edge = Clock::Micros();
+        Step();
+        _lastEdge = Clock::Micros();
+        _transmitMicros += _lastEdge - edge;
+      }
+      while ( ( IsBusy() || Load() ) && ( Clock::Micros() - start < _passBudgetMicros ) );
+
+      if ( IsBusy() || Load() )
+      {
+        delay = 0;
+      }
+    }
+
+    // Sends everything that is waiting right away, for the few places that block anyway.
+    void Flush()
+    {
+      if ( _busless )
+      {
+        SkipBus();
+        return;
+      }
+      while ( IsBusy() || Load() )
+      {
+        unsigned long start = Clock::Micros();
+        Step();
+        _transmitMicros += Clock::Micros() - start;
+        delayMicroseconds(_edgeMicros);
+      }
+      _lastEdge = Clock::Micros();
+    }
+
+    // For the host checks, which only care what is shown and not when.  Everything counts as
+    // sent as soon as it is drawn, without the pins ever being touched.
+    void SetBusless(bool busless)
+    {
+      _busless = busless;
+    }
+
+    bool IsBusy()
+    {
+      return StepIdle != _txStep;
+    }
+
+    unsigned long GetBytesSent()
+    {
+      return _bytesSent;
+    }
+
+    unsigned long GetFramesSent()
+    {
+      return _framesSent;
+    }
+
+    // The time spent actually driving the bus, not counting the waits between edges.
+    unsigned long GetTransmitMicros()
+    {
+      return _transmitMicros;
+    }
+
+    // Every change to the frame or brightness is counted, along with how many of them have made it
+    // all the way out to the display.  So to know when something drawn is actually showing, note
+    // the count after drawing it and wait till that many are shown.
+    unsigned long GetChangeCount()
+    {
+      return _changes;
+    }
+
+    unsigned long GetChangesShown()
+    {
+      return _changesShown;
+    }
+
+  private:
+
+    void setSegments(const uint8_t * segments, uint8_t length, uint8_t pos = 0)
+    {
+      if ( memcmp(_frame + pos, segments, length) )
+      {
+        memcpy(_frame + pos, segments, length);
+        _framePending = true;
+        ++_changes;
+      }
+    }
+
+    // Copies whatever has changed into the bytes to send, so the frame can keep being drawn
+    // while they go out.  Returns false if there is nothing to send.
+    bool Load()
+    {
+      _txLength = 0;
+      _txEnds = 0;
+      if ( _framePending )
+      {
+        // Each command is its own transaction, the segments go with the address command.
+        _tx[_txLength++] = _cmdData;
+        _txEnds |= 1 << (_txLength - 1);
+        _tx[_txLength++] = _cmdAddress;
+        for ( uint8_t i = 0; i < _digits; ++i )
+        {
+          _tx[_txLength++] = _frame[i];
+        }
+        _txEnds |= 1 << (_txLength - 1);
+        _framePending = false;
+        ++_framesSent;
+      }
+      if ( _controlPending )
+      {
+        _tx[_txLength++] = _control;
+        _txEnds |= 1 << (_txLength - 1);
+        _controlPending = false;
+      }
+      if ( 0 == _txLength )
+      {
+        return false;
+      }
+      _txByte = 0;
+      _txStep = StepStart;
+      _txChanges = _changes;
+      return true;
+    }
+
+    void SkipBus()
+    {
+      while ( Load() )
+      {
+        _bytesSent += _txLength;
+        _txStep = StepIdle;
+        _changesShown = _txChanges;
+      }
+    }
+
+    // Moves the bus along by a single edge.  The bits go out lowest first, each one set while
+    // the clock is low and read by the chip when it goes high, with a 9th clock for the ack.
+    void Step()
+    {
+      switch ( _txStep )
+      {
+        case StepStart:
+          // Data going low while the clock is high starts a transaction.
+          PullLow(_pinDio);
+          _txStep = StepClockLow;
+          _txBit = 0;
+          break;
+
+        case StepClockLow:
+          PullLow(_pinClk);
+          _txStep = StepData;
+          break;
+
+        case StepData:
+          // For the ack the line is let go, so the chip can pull it low.
+          if ( ( _txBit < 8 ) && !( _tx[_txByte] & (1 << _txBit) ) )
+          {
+            PullLow(_pinDio);
+          }
+          else
+          {
+            Release(_pinDio);
+          }
+          _txStep = StepClockHigh;
+          break;
+
+        case StepClockHigh:
+          Release(_pinClk);
+          _txStep = ( ++_txBit <= 8 ) ? StepClockLow : StepByteDone;
+          break;
+
+        case StepByteDone:
+          PullLow(_pinClk);
+          ++_bytesSent;
+          if ( _txEnds & (1 << _txByte++) )
+          {
+            _txStep = StepStopData;
+          }
+          else
+          {
+            _txStep = StepData;
+            _txBit = 0;
+          }
+          break;
+
+        case StepStopData:
+          PullLow(_pinDio);
+          _txStep = StepStopClock;
+          break;
+
+        case StepStopClock:
+          Release(_pinClk);
+          _txStep = StepStop;
+          break;
+
+        case StepStop:
+          // Data going high while the clock is high ends it.
+          Release(_pinDio);
+          if ( _txByte < _txLength )
+          {
+            _txStep = StepStart;
+          }
+          else
+          {
+            _txStep = StepIdle;
+            _changesShown = _txChanges;
+          }
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    static void PullLow(int pin)
+    {
+      pinMode(pin, OUTPUT);
+    }
+
+    static void Release(int pin)
+    {
+      pinMode(pin, INPUT);
     }
 
   private:
+    // So the cost of the character lookup can be measured on its own.
+    friend class Benchmark;
+
     _getSegments(char c)
     {
       // Would be interesting to create a 255 sized array for all possible characters
       // rather than this a bunch of one off handling of letters, numbers, and special characters.
-      static const uint8_t letters[] =
+      // The table lives in flash so it doesn't take up any RAM.
+      static const uint8_t letters[] PROGMEM =
       {
         Segments_A,
         Segments_b,
@@ -138,18 +490,31 @@ class DisplaySegments
         Segments_Y,
         Segments_Z,
       };
+      static const uint8_t digits[] PROGMEM =
+      {
+        Segments_0,
+        Segments_1,
+        Segments_2,
+        Segments_3,
+        Segments_4,
+        Segments_5,
+        Segments_6,
+        Segments_7,
+        Segments_8,
+        Segments_9,
+      };
 
       if ( (c >= 'A') && (c <= 'Z') )
       {
-        return letters[c - 'A'];
+        return pgm_read_byte(&letters[c - 'A']);
       }
       else if ( (c >= 'a') && (c <= 'z') )
       {
-        return letters[c - 'a'];
+        return pgm_read_byte(&letters[c - 'a']);
       }
       else if ( (c >= '0') && (c <= '9') )
       {
-        return _display.encodeDigit(c - '0');
+        return pgm_read_byte(&digits[c - '0']);
       }
       switch ( c )
       {
@@ -185,10 +550,70 @@ class DisplaySegments
     }
 
   private:
-    TM1637Display _display;
+
+    enum TransmitStep : uint8_t
+    {
+      StepIdle,
+      StepStart,
+      StepClockLow,
+      StepData,
+      StepClockHigh,
+      StepByteDone,
+      StepStopData,
+      StepStopClock,
+      StepStop,
+    };
 
     static const size_t _digits = 4;
 
+    // The library waits 100us after every edge, which is plenty for the pull ups to bring a line
+    // back high.  We wait at least as long, but usually it is the rest of the pass.
+    static const unsigned long _edgeMicros = 100;
+
+    // How long each pass spends sending.
+    static const unsigned long _passBudgetMicros = 1000;
+
+    static const uint8_t _cmdData = 0x40;     // Write data with the address going up by itself.
+    static const uint8_t _cmdAddress = 0xC0;  // Starting from the first digit.
+    static const uint8_t _cmdControl = 0x80;
+    static const uint8_t _controlOn = 0x08;
+
+    const int _pinClk;
+    const int _pinDio;
+    uint8_t _frame[_digits];
+    uint8_t _control;
+    bool _framePending;
+    bool _controlPending;
+
+    // What is being sent: the command bytes with a bit set in _txEnds for each one that ends a
+    // transaction, and where we are in them.
+    TransmitStep _txStep;
+    uint8_t _tx[_digits + 3];
+    uint8_t _txLength;
+    uint8_t _txEnds;
+    uint8_t _txByte;
+    uint8_t _txBit;
+    unsigned long _lastEdge;
+
+    unsigned long _bytesSent;
+    unsigned long _framesSent;
+    unsigned long _transmitMicros;
+    unsigned long _changes;
+    unsigned long _txChanges;
+    unsigned long _changesShown;
+    bool _busless;
+
+    static const uint8_t Segments_0 = SEG_A | SEG_B | SEG_C | SEG_D | SEG_E | SEG_F;
+    static const uint8_t Segments_1 = SEG_B | SEG_C;
+    static const uint8_t Segments_2 = SEG_A | SEG_B | SEG_D | SEG_E | SEG_G;
+    static const uint8_t Segments_3 = SEG_A | SEG_B | SEG_C | SEG_D | SEG_G;
+    static const uint8_t Segments_4 = SEG_B | SEG_C | SEG_F | SEG_G;
+    static const uint8_t Segments_5 = SEG_A | SEG_C | SEG_D | SEG_F | SEG_G;
+    static const uint8_t Segments_6 = SEG_A | SEG_C | SEG_D | SEG_E | SEG_F | SEG_G;
+    static const uint8_t Segments_7 = SEG_A | SEG_B | SEG_C;
+    static const uint8_t Segments_8 = SEG_A | SEG_B | SEG_C | SEG_D | SEG_E | SEG_F | SEG_G;
+    static const uint8_t Segments_9 = SEG_A | SEG_B | SEG_C | SEG_D | SEG_F | SEG_G;
+
     static const uint8_t Segments_A = SEG_A | SEG_B | SEG_C | SEG_E | SEG_F | SEG_G;
     static const uint8_t Segments_b = SEG_C | SEG_D | SEG_E | SEG_F | SEG_G;
     static const uint8_t Segments_C = SEG_A | SEG_D | SEG_E | SEG_F;  // Avoid as not to confuse with [
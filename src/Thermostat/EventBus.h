@@ -0,0 +1,202 @@
+#pragma once
+
+#include "ArduinoHandler.h"
+
+// The types double as bits so a subscriber can ask for any combination of them.
+enum EventType : uint8_t
+{
+  EventTemp    = 0x01,  // value is the new temp in celsius (or an error code).
+  EventRelay   = 0x02,  // value is whether the relay should be on.
+  EventConfig  = 0x04,  // value is the new trigger temp in fahrenheit.
+  EventReading = 0x08,  // value is every temp read, even if it didn't change (in celsius).
+  EventFault   = 0x10,  // value is whether the sensor has failed for long enough to force the relay.
+  EventAll     = 0xFF
+};
+
+struct Event
+{
+  EventType type;
+  uint8_t zone;
+  int value;
+};
+
+// Fixed size publish/subscribe bus.  Publishing just queues the event, nothing is called back
+// until the bus is dispatched at the end of a worker pass.  Only a limited batch is dispatched
+// per pass, so an event storm can't hold up the loop, and nothing on the bus ever allocates.
+//
+// The relay events are the one thing we can't afford to drop, so they don't go in the queue at
+// all.  Each zone just has a slot for the latest state it should be in, which is dispatched
+// ahead of the queue.  Only the latest one matters to a relay anyway.
+class EventBus
+{
+  public:
+
+    EventBus()
+      : _subscriberCount(0)
+      , _head(0)
+      , _count(0)
+      , _relayPending(0)
+      , _relayOn(0)
+      , _highWater(0)
+      , _dropped(0)
+      , _dispatched(0)
+      , _dispatchMicros(0)
+      , _maxDispatchMicros(0)
+    {
+    }
+
+    // The zone can be used to only get the events for a single zone.
+    template <typename T>
+    bool Subscribe(uint8_t eventMask, T* obj, void (T::*method)(const Event &), uint8_t zone = AnyZone)
+    {
+      if ( _subscriberCount >= _maxSubscribers )
+      {
+        return false;
+      }
+      Subscriber & subscriber = _subscribers[_subscriberCount++];
+      subscriber.eventMask = eventMask;
+      subscriber.zone = zone;
+      subscriber.handler.Register(obj, method);
+      return true;
+    }
+
+    bool Publish(EventType type, uint8_t zone, int value)
+    {
+      if ( ( EventRelay == type ) && ( zone < _relaySlots ) )
+      {
+        uint8_t bit = 1 << zone;
+        _relayPending |= bit;
+        _relayOn = value ? (_relayOn | bit) : (_relayOn & ~bit);
+        return true;
+      }
+      if ( _count >= _queueSize )
+      {
+        ++_dropped;
+        return false;
+      }
+      Event & event = _queue[(_head + _count) % _queueSize];
+      event.type = type;
+      event.zone = zone;
+      event.value = value;
+      if ( ++_count > _highWater )
+      {
+        _highWater = _count;
+      }
+      return true;
+    }
+
+    void Dispatch(unsigned long & delay)
+    {
+      // The relay slots go first, and don't count against the batch, since there are only a few.
+      for ( uint8_t zone = 0; ( zone < _relaySlots ) && _relayPending; ++zone )
+      {
+        uint8_t bit = 1 << zone;
+        if ( _relayPending & bit )
+        {
+          _relayPending &= ~bit;
+          Event event = { EventRelay, zone, ( _relayOn & bit ) ? 1 : 0 };
+          Deliver(event);
+        }
+      }
+
+      for ( uint8_t batch = 0; ( batch < _dispatchBatch ) && ( _count > 0 ); ++batch )
+      {
+        // Copy it out first since a subscriber may publish more events while we dispatch this one.
+        const Event event = _queue[_head];
+        _head = (_head + 1) % _queueSize;
+        --_count;
+        Deliver(event);
+      }
+
+      // If there is anything left over (or a subscriber has set a relay), we want the next pass
+      // to come right away.
+      if ( ( _count > 0 ) || _relayPending )
+      {
+        delay = 0;
+      }
+    }
+
+    uint8_t GetHighWater()
+    {
+      return _highWater;
+    }
+
+    unsigned long GetDropped()
+    {
+      return _dropped;
+    }
+
+    unsigned long GetDispatched()
+    {
+      return _dispatched;
+    }
+
+    unsigned long GetAverageDispatchMicros()
+    {
+      return _dispatched ? _dispatchMicros / _dispatched : 0;
+    }
+
+    unsigned long GetMaxDispatchMicros()
+    {
+      return _maxDispatchMicros;
+    }
+
+  public:
+
+    static const uint8_t AnyZone = 0xFF;
+
+  private:
+
+    void Deliver(const Event & event)
+    {
+      unsigned long start = micros();
+      for ( uint8_t i = 0; i < _subscriberCount; ++i )
+      {
+        Subscriber & subscriber = _subscribers[i];
+        if ( ( subscriber.eventMask & event.type ) &&
+             ( ( AnyZone == subscriber.zone ) || ( event.zone == subscriber.zone ) ) )
+        {
+          subscriber.handler.Invoke(event);
+        }
+      }
+      unsigned long elapsed = micros() - start;
+
+      ++_dispatched;
+      _dispatchMicros += elapsed;
+      if ( elapsed > _maxDispatchMicros )
+      {
+        _maxDispatchMicros = elapsed;
+      }
+    }
+
+  private:
+
+    static const uint8_t _maxSubscribers = 8;
+    static const uint8_t _queueSize = 16;
+    static const uint8_t _dispatchBatch = 8;
+    static const uint8_t _relaySlots = 8;  // one bit each
+
+    struct Subscriber
+    {
+      uint8_t eventMask;
+      uint8_t zone;
+      ArduinoHandlerParam<const Event &> handler;
+    };
+
+    Subscriber _subscribers[_maxSubscribers];
+    uint8_t _subscriberCount;
+
+    Event _queue[_queueSize];
+    uint8_t _head;
+    uint8_t _count;
+
+    // A bit per zone.
+    uint8_t _relayPending;
+    uint8_t _relayOn;
+
+    uint8_t _highWater;
+    unsigned long _dropped;
+    unsigned long _dispatched;
+    unsigned long _dispatchMicros;
+    unsigned long _maxDispatchMicros;
+};
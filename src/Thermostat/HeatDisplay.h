@@ -2,67 +2,142 @@
 
 #include "DisplaySegments.h"
 #include "Thermostat.h"
+#include "RelayControl.h"
+#include "EventBus.h"
+#include "ArduinoWorker.h"
+#include "Coroutine.h"
 
 class HeatDisplay
 {
   public:
-    HeatDisplay(int pinClk, int pinDio, PersistedData * storage, Thermostat * thermostat)
+    HeatDisplay(int pinClk, int pinDio, PersistedData * storage, Thermostat * thermostats, RelayControl * relays, uint8_t zoneCount = 1)
       : _display(pinClk, pinDio)
       , _storage(storage)
-      , _thermostat(thermostat)
+      , _thermostats(thermostats)
+      , _relays(relays)
+      , _zoneCount(zoneCount)
+      , _thermostat(thermostats)
+      , _page(PageTemp)
       , _celsius(storage->get_Celsius())
       , _brightness(storage->get_LedBrigtness())
       , _displayOn(storage->get_LedOn())
-      , _configModeTimeStamp(0)
+      , _worker(nullptr)
+      , _timerConfigTimeOut(ArdunioWorker::InvalidTimer)
+      , _timerBlink(ArdunioWorker::InvalidTimer)
+      , _timerConfigLimit(ArdunioWorker::InvalidTimer)
+      , _timerIdle(ArdunioWorker::InvalidTimer)
+      , _idleTimeout(0)
+      , _idleDim(false)
+      , _idleBrightness(DisplaySegments::Brightness::LedMin)
+      , _idle(false)
+      , _ambientPin(0)
+      , _ambientReading(0)
+      , _ambientLevel(DisplaySegments::Brightness::LedMax)
+      , _configMode(false)
       , _configModeDimmer(false)
+      , _repeatUp(false)
+      , _repeatDown(false)
+      , _repeats(0)
       , _blinkOff(false)
+      , _limitOff(false)
+      , _dirty(false)
+      , _startup(this)
     {
       _display.setBrightness(_brightness);
     }
 
-    void TestBrightness(unsigned long msDelay)
+    // All the config mode timing is done with one shot timers that are only running while
+    // in config mode, so the display doesn't need any worker time the rest of the time.
+    void RegisterTimers(ArdunioWorker * worker)
     {
-      // We first go up to max brightness.
-      for ( DisplaySegments::Brightness brightness = DisplaySegments::Brightness::LedMin; brightness <= DisplaySegments::Brightness::LedMax; brightness = brightness + 1 )
-      {
-        _display.setBrightness(brightness);
-        _display.showNumberDec(8888);
-        delay(msDelay);
-      }
+      _worker = worker;
+      _timerConfigTimeOut = _worker->AddTimer(this, &HeatDisplay::ExitConfigMode);
+      _timerBlink = _worker->AddTimer(this, &HeatDisplay::ToggleBlink);
+      _timerConfigLimit = _worker->AddTimer(this, &HeatDisplay::EndConfigLimit);
+      _timerIdle = _worker->AddTimer(this, &HeatDisplay::GoIdle);
+      Wake();
+    }
+
+    // With no button pressed for this long, the display blanks (or dims if a brightness is given)
+    // till the next press.  These need to be called before the timers are registered.
+    void SetIdleTimeout(unsigned long timeout)
+    {
+      _idleTimeout = timeout;
+    }
+
+    void SetIdleBrightness(DisplaySegments::Brightness brightness)
+    {
+      _idleDim = true;
+      _idleBrightness = brightness;
+    }
 
-      // Then go back to where we want to end (or 1 from it).  Careful to not wrap the unsigned int endlessly.
-      for ( DisplaySegments::Brightness brightness = DisplaySegments::Brightness::LedMax - 1; brightness > _brightness; brightness = brightness - 1 )
+    // Dims the display in a dark room, from a light sensor on this analog pin (higher is brighter).
+    // The brightness setting is then the most it goes to.  CheckAmbientLight needs to be run as a worker.
+    void SetAmbientLight(int pin)
+    {
+      _ambientPin = pin;
+      _ambientReading = analogRead(_ambientPin);
+      _ambientLevel = (DisplaySegments::Brightness)(_ambientReading / _ambientBand);
+    }
+
+    void CheckAmbientLight(unsigned long & delay)
+    {
+      // The reading is smoothed and only moves to another level once it is well into it, so a
+      // light on a dimmer (or a reading right on the edge) doesn't keep changing the brightness.
+      _ambientReading += ((int)analogRead(_ambientPin) - _ambientReading) / 4;
+      int center = _ambientLevel * _ambientBand + _ambientBand / 2;
+      if ( abs(_ambientReading - center) > _ambientBand * 3 / 4 )
       {
-        _display.setBrightness(brightness);
-        _display.showNumberDec(8888);
-        delay(msDelay);
+        _ambientLevel = (DisplaySegments::Brightness)(_ambientReading / _ambientBand);
+        Invalidate();
       }
+      delay = _ambientInterval;
+    }
 
-      // Since we go to just before the set brightness to avoid endless loop,
-      // we need to execute this one more time.
-      _display.setBrightness(_brightness);
-      _display.showNumberDec(8888);
-      delay(msDelay);
-
-      if ( !_displayOn )
+    // Called as soon as either button goes down.  Any press wakes the display, but if it was
+    // blank that is all the press does, since the user couldn't see what they were changing.
+    void OnButtonPress(bool & handled)
+    {
+      if ( _idle && !_idleDim )
       {
-        // This should show 'off' briefly.
-        ShowBrightness();
-        delay(msDelay);
+        handled = true;
       }
+      _repeats = 0;
+      Wake();
+    }
 
-      _display.clear();
+    // The startup message and brightness test run as a coroutine so they don't hold up the loop
+    // (and the first sensor reads) while they play.  Nothing else is shown till they are done.
+    // These need to be called after the timers are registered.
+    void DisplayMessage(const __FlashStringHelper * text, unsigned long msDelay)
+    {
+      _startup.message = text;
+      _startup.msScroll = msDelay;
+      _startup.Start(_worker);
     }
 
-    bool DisplayMessage(char * text, unsigned long msDelay)
+    void TestBrightness(unsigned long msDelay)
     {
-      return _display.scrollText(text, msDelay);
+      _startup.msBrightness = msDelay;
+      _startup.Start(_worker);
     }
 
     void ChangeConfigUp()
+    {
+      StepConfigUp(1);
+    }
+
+    void ChangeConfigDown()
+    {
+      StepConfigDown(1);
+    }
+
+    // A hold steps the temp by more and more (see RepeatSteps()), but the brightness only has a
+    // few levels so it always goes one at a time.
+    void StepConfigUp(int steps)
     {
       // If we've already entered config mode, then we can adjust the temp.
-      if ( _configModeTimeStamp )
+      if ( _configMode )
       {
         if ( _configModeDimmer )
         {
@@ -86,21 +161,21 @@ class HeatDisplay
         else
         {
           int oldTemp = _thermostat->GetTriggerTemp(_celsius);
-          int newTemp = _thermostat->IncTriggerTemp(_celsius);
+          int newTemp = _thermostat->IncTriggerTemp(_celsius, steps);
           if ( oldTemp == newTemp )
           {
             ConfigLimit();
           }
         }
+        _repeatUp = true;
       }
-      _configModeTimeStamp = millis();
-      UpdateDisplay();
+      StartConfigMode();
     }
 
-    void ChangeConfigDown()
+    void StepConfigDown(int steps)
     {
       // If we've already entered config mode, then we can adjust the temp.
-      if ( _configModeTimeStamp )
+      if ( _configMode )
       {
         if ( _configModeDimmer )
         {
@@ -122,109 +197,257 @@ class HeatDisplay
         else
         {
           int oldTemp = _thermostat->GetTriggerTemp(_celsius);
-          int newTemp = _thermostat->DecTriggerTemp(_celsius);
+          int newTemp = _thermostat->DecTriggerTemp(_celsius, steps);
           if ( oldTemp == newTemp )
           {
             ConfigLimit();
           }
         }
+        _repeatDown = true;
+      }
+      StartConfigMode();
+    }
+
+    // Once a button has changed the setting in config mode, holding it down keeps changing it.
+    // Otherwise the hold is left for its long press, so that still works in config mode as long
+    // as it comes before any changes (with the same button).
+    void RepeatConfigUp(bool & repeated)
+    {
+      if ( _configMode && _repeatUp )
+      {
+        StepConfigUp(RepeatSteps());
+        repeated = true;
+      }
+    }
+
+    void RepeatConfigDown(bool & repeated)
+    {
+      if ( _configMode && _repeatDown )
+      {
+        StepConfigDown(RepeatSteps());
+        repeated = true;
       }
-      _configModeTimeStamp = millis();
-      UpdateDisplay();
     }
 
     void ChangeConfigMode()
     {
-      _configModeTimeStamp = millis();
       _configModeDimmer = !_configModeDimmer;
+      _repeatUp = false;
+      _repeatDown = false;
+      StartConfigMode();
     }
 
     void ChangeMeasurement()
     {
       _celsius = !_celsius;
       _storage->set_Celsius(_celsius);
-      UpdateDisplay();
+      Invalidate();
     }
 
-    void UpdateHeatCelsius(int tempCelsius)
+    void OnTempEvent(const Event & event)
     {
-      // We only want to actually display the change if we aren't in the middle of changing config.
-      if ( 0 == _configModeTimeStamp )
+      // We only want to actually display the change if it is for the zone we are showing
+      // and we aren't in the middle of changing config.
+      if ( ( event.zone == _thermostat->GetZone() ) && !_configMode )
       {
-        UpdateDisplay();
+        Invalidate();
       }
     }
 
-    void HandleBlink(unsigned long & delay)
+    void CyclePages(unsigned long & delay)
     {
-      // See if we are in config mode.
-      if ( _configModeTimeStamp > 0 )
+      // Don't switch zones out from under the user while they are changing its config.
+      // We'll try again once they are done.
+      if ( _configMode )
       {
-        // We want to do the opposite of current state.
-        if ( _blinkOff )
-        {
-          // Updating the display will also turn blink off.
-          delay = _blinkIntervalOn;
-          UpdateDisplay();
-        }
-        else
-        {
-          // For a smoother experience, it would be best to ensure if the use pressed
-          // a button that we don't blink it off till at least the blink on interval.
-          unsigned long elapsed = millis() - _configModeTimeStamp;
-          if ( elapsed < _blinkIntervalOn )
+        _page = PageTemp;
+        delay = _zoneCycleTime;
+        return;
+      }
+
+      // Each zone first shows its label briefly (if there is more than one), then its temp for
+      // most of the cycle and finally how much its heat has been on today.
+      switch ( _page )
+      {
+        case PageLabel:
+          _page = PageTemp;
+          delay = _zoneCycleTime - _zoneLabelTime - _dutyTime;
+          break;
+
+        case PageTemp:
+          _page = PageDuty;
+          delay = _dutyTime;
+          break;
+
+        case PageDuty:
+          if ( _zoneCount > 1 )
           {
-            // Set the callback to when we want to blink off.
-            delay = _blinkIntervalOn - elapsed;
+            _thermostat = &_thermostats[(_thermostat->GetZone() + 1) % _zoneCount];
+            _page = PageLabel;
+            delay = _zoneLabelTime;
           }
           else
           {
-            // If we are blinking to off, then clear display set blink off interval.
-            _blinkOff = true;
-            delay = _blinkIntervalOff;
-            _display.clear();
+            _page = PageTemp;
+            delay = _zoneCycleTime - _dutyTime;
           }
-        }
+          break;
       }
-      else
+      Invalidate();
+    }
+
+    // The first few repeats of a hold go a degree at a time, so a small change is still easy to
+    // stop on.  Then they take bigger and bigger steps, so the whole range takes about a second.
+    int RepeatSteps()
+    {
+      if ( _repeats < 255 )
+      {
+        ++_repeats;
+      }
+      if ( _repeats <= 3 )
+      {
+        return 1;
+      }
+      if ( _repeats <= 6 )
       {
-        // If we are not in config mode, the nothing to blink.
-        delay = _blinkIntervalOn;
+        return 2;
       }
+      if ( _repeats <= 8 )
+      {
+        return 5;
+      }
+      return 10;
     }
 
     void ConfigLimit()
     {
-      _display.clear();
-      delay(_configLimitBlinkOff);
+      // Briefly blank the display to show we've hit the limit.  The timer will bring it back.
+      // While a button is held at the limit, this keeps it flashing rather than staying blank.
+      if ( _limitOff )
+      {
+        return;
+      }
+      _limitOff = true;
+      _worker->StartTimer(_timerConfigLimit, _configLimitBlinkOff);
+      Invalidate();
+    }
+
+    // Called once at the end of every worker pass.  Everything else just marks the display as
+    // invalid, so no matter how many things changed during the pass we only repaint once.
+    // The repaint only draws into the frame, which then goes out to the display a bit at a time
+    // over the next passes.
+    void Render(unsigned long & delay)
+    {
+      if ( _dirty && !_startup.IsRunning() )
+      {
+        _dirty = false;
+        UpdateDisplay();
+      }
+      _display.Transmit(delay);
+    }
+
+    DisplaySegments & GetSegments()
+    {
+      return _display;
+    }
+
+    bool IsConfigMode()
+    {
+      return _configMode;
     }
 
   private:
-    void UpdateDisplay()
+    void Invalidate()
     {
-      // Anytime we update the display, indicate that we aren't currently off for blinking
-      // since we are about the update the display and show something.
+      _dirty = true;
+    }
+
+    void StartConfigMode()
+    {
+      // Every button press (re)starts the time out and shows the display for the full blink on
+      // interval, so it never blinks off right as the user changes something.
+      _configMode = true;
+      _blinkOff = false;
+      _worker->StartTimer(_timerConfigTimeOut, _configTimeOut);
+      _worker->StartTimer(_timerBlink, _blinkIntervalOn);
+      Invalidate();
+    }
+
+    void ExitConfigMode()
+    {
+      _configMode = false;
+      _configModeDimmer = false;
+      _repeatUp = false;
+      _repeatDown = false;
       _blinkOff = false;
+      _worker->CancelTimer(_timerBlink);
+      Invalidate();
+    }
 
-      // If we are in config mode, see if we should time out of it.
-      if ( _configModeTimeStamp > 0 )
+    void Wake()
+    {
+      if ( _idle )
       {
-        // Check how long since the user did something in config mode.
-        // If we are timing out of config mode, show the current temp again.  
-        unsigned long configLen = millis() - _configModeTimeStamp;
-        if ( configLen > _configTimeOut )
-        {
-          // Reset us out of config mode.
-          _configModeTimeStamp = 0;
-          _configModeDimmer = false;
-        }
+        _idle = false;
+        Invalidate();
+      }
+      if ( _idleTimeout )
+      {
+        _worker->StartTimer(_timerIdle, _idleTimeout);
+      }
+    }
+
+    void GoIdle()
+    {
+      _idle = true;
+      Invalidate();
+    }
+
+    // The brightness to show at when not in config mode, after the idle dimming and the room light.
+    DisplaySegments::Brightness GetShownBrightness()
+    {
+      DisplaySegments::Brightness brightness = _brightness;
+      if ( _ambientLevel < brightness )
+      {
+        brightness = _ambientLevel;
       }
+      if ( _idle && _idleBrightness < brightness )
+      {
+        brightness = _idleBrightness;
+      }
+      return brightness;
+    }
+
+    void ToggleBlink()
+    {
+      _blinkOff = !_blinkOff;
+      _worker->StartTimer(_timerBlink, _blinkOff ? _blinkIntervalOff : _blinkIntervalOn);
+      Invalidate();
+    }
 
+    void EndConfigLimit()
+    {
+      _limitOff = false;
+      Invalidate();
+    }
+
+    void UpdateDisplay()
+    {
       // If we aren't in config mode, just show the temp.
-      if ( 0 == _configModeTimeStamp )
+      // Since only what changed ever goes out to the display, being blank costs no bus time.
+      if ( !_configMode )
       {
-        _display.setBrightness(_brightness, _displayOn);
-        if ( _displayOn )
+        bool on = _displayOn && !( _idle && !_idleDim );
+        _display.setBrightness(GetShownBrightness(), on);
+        if ( on && ( PageLabel == _page ) )
+        {
+          ShowZone();
+        }
+        else if ( on && ( PageDuty == _page ) )
+        {
+          ShowDuty();
+        }
+        else if ( on )
         {
           ShowTemp(_thermostat->GetCurrentTemp(_celsius));
         }
@@ -233,6 +456,10 @@ class HeatDisplay
           _display.clear();
         }
       }
+      else if ( _blinkOff || _limitOff )
+      {
+        _display.clear();
+      }
       else
       {
         // This is config mode, so always show it even if the display is off.
@@ -252,7 +479,7 @@ class HeatDisplay
     {
       if ( Thermostat::IsErr(tempDisplay) )
       {
-        _display.showText("Err");
+        _display.showText(F("Err"));
         _display.showChar(DisplaySegments::Degree, DisplaySegments::Position::PosForth);
       }
       else if ( tempDisplay < 100 )
@@ -268,22 +495,131 @@ class HeatDisplay
       }
     }
 
+    void ShowZone()
+    {
+      // Zones are shown to the user starting at 1.
+      _display.showText(F("Zn"));
+      _display.showNumberDec((int)_thermostat->GetZone() + 1, false, 1, DisplaySegments::Position::PosForth);
+    }
+
+    void ShowDuty()
+    {
+      // The percent of today so far the zone has been heating.
+      _display.showText(F("d"));
+      _display.showNumberDec((int)_relays[_thermostat->GetZone()].GetDutyToday(), false, 3, DisplaySegments::Position::PosSecond);
+    }
+
     void ShowBrightness()
     {
       if ( _displayOn )
       {
-        _display.showText("led");
+        _display.showText(F("led"));
         _display.showNumberDec((int)_brightness + 1, false, 1, DisplaySegments::Position::PosForth);
       }
       else
       {
-        _display.showText("off");
+        _display.showText(F("off"));
       }
     }
 
+  private:
+
+    enum Page : uint8_t
+    {
+      PageLabel,
+      PageTemp,
+      PageDuty
+    };
+
+    class StartupSequence : public Coroutine
+    {
+      public:
+
+        StartupSequence(HeatDisplay * owner)
+          : message(nullptr)
+          , msScroll(0)
+          , msBrightness(0)
+          , _owner(owner)
+          , _text(nullptr)
+          , _pos(0)
+          , _brightness(0)
+        {
+        }
+
+        const __FlashStringHelper * message;
+        unsigned long msScroll;
+        unsigned long msBrightness;
+
+      protected:
+
+        virtual void Run()
+        {
+          DisplaySegments & display = _owner->_display;
+
+          CO_BEGIN();
+
+          if ( message )
+          {
+            // Scroll the text in from the right and then off to the left.
+            for ( _pos = DisplaySegments::Position::PosForth; _pos > DisplaySegments::Position::PosFirst; --_pos )
+            {
+              display.showText(message, (DisplaySegments::Position)_pos);
+              CO_AWAIT_MS(msScroll);
+            }
+            for ( _text = (PGM_P)message; pgm_read_byte(_text); ++_text )
+            {
+              display.showText((const __FlashStringHelper *)_text);
+              CO_AWAIT_MS(msScroll);
+            }
+            display.clear();
+          }
+
+          if ( msBrightness )
+          {
+            // We first go up to max brightness.
+            for ( _brightness = DisplaySegments::Brightness::LedMin; _brightness <= DisplaySegments::Brightness::LedMax; ++_brightness )
+            {
+              display.setBrightness((DisplaySegments::Brightness)_brightness);
+              display.showNumberDec(8888);
+              CO_AWAIT_MS(msBrightness);
+            }
+
+            // Then go back down to where we want to end.
+            for ( _brightness = DisplaySegments::Brightness::LedMax - 1; _brightness >= _owner->_brightness; --_brightness )
+            {
+              display.setBrightness((DisplaySegments::Brightness)_brightness);
+              display.showNumberDec(8888);
+              CO_AWAIT_MS(msBrightness);
+            }
+
+            if ( !_owner->_displayOn )
+            {
+              // This should show 'off' briefly.
+              _owner->ShowBrightness();
+              CO_AWAIT_MS(msBrightness);
+            }
+
+            display.clear();
+          }
+
+          // Now show whatever the display should be showing.
+          _owner->Invalidate();
+
+          CO_END();
+        }
+
+      private:
+
+        HeatDisplay * _owner;
+        PGM_P _text;
+        int8_t _pos;
+        int8_t _brightness;
+    };
+
   public:
 
     static const unsigned long BUTTON_LONG_PRESS = 2 /*seconds*/ * 1000;
+    static const unsigned long BUTTON_REPEAT_DELAY = 400 /*ms*/;
 
   private:
 
@@ -291,16 +627,50 @@ class HeatDisplay
     static const unsigned long _configLimitBlinkOff = 100 /*ms*/;
     static const unsigned long _blinkIntervalOn = 500 /*ms*/;
     static const unsigned long _blinkIntervalOff = 500 /*ms*/;
+    static const unsigned long _zoneCycleTime = 5 /*seconds*/ * 1000;
+    static const unsigned long _zoneLabelTime = 1 /*seconds*/ * 1000;
+    static const unsigned long _dutyTime = 1 /*seconds*/ * 1000;
+    static const unsigned long _ambientInterval = 500 /*ms*/;
+    static const int _ambientBand = 1024 / (DisplaySegments::Brightness::LedMax + 1);
     
     DisplaySegments _display;
     PersistedData * _storage;
+
+    // All of the zones and the one we are currently showing (and configuring).
+    Thermostat * _thermostats;
+    RelayControl * _relays;
+    const uint8_t _zoneCount;
     Thermostat * _thermostat;
+    Page _page;
 
     bool _celsius;
     DisplaySegments::Brightness _brightness;
     bool _displayOn;
-    unsigned long _configModeTimeStamp;
+
+    ArdunioWorker * _worker;
+    ArdunioWorker::TimerHandle _timerConfigTimeOut;
+    ArdunioWorker::TimerHandle _timerBlink;
+    ArdunioWorker::TimerHandle _timerConfigLimit;
+    ArdunioWorker::TimerHandle _timerIdle;
+
+    unsigned long _idleTimeout;
+    bool _idleDim;
+    DisplaySegments::Brightness _idleBrightness;
+    bool _idle;
+
+    int _ambientPin;
+    int _ambientReading;
+    DisplaySegments::Brightness _ambientLevel;
+
+    bool _configMode;
     bool _configModeDimmer;
+    bool _repeatUp;
+    bool _repeatDown;
+    uint8_t _repeats;
     bool _blinkOff;
+    bool _limitOff;
+    bool _dirty;
+
+    StartupSequence _startup;
 };
 
@@ -0,0 +1,230 @@
+#pragma once
+
+#include "ButtonPress.h"
+#include "DisplaySegments.h"
+#include "Clock.h"
+
+// Times how long each button press takes to show on the display, split into the stages it goes
+// through on the way:
+//
+//   debounce  from the button actually changing till it is handled (the polling and settling)
+//   handler   the press (or short press) handler itself
+//   pass      the rest of that pass, up to the display being redrawn at the end of it
+//   bus       getting the redrawn frame out to the display (after anything already going out)
+//
+// Every stage is timed with Clock::Micros(), so they all add up to the time from the edge to the
+// display.  On the board that is just micros().  On the virtual clock of a trace replay it is the
+// time the workers were scheduled for plus however long the code took (and anything it blocked
+// on, like a slow sensor read), so it comes out as the board would have seen it.  A press that
+// doesn't change the display (like one that only keeps it from going idle) has nothing to show,
+// so it isn't counted.
+//
+// Only one press is followed at a time.  If another is handled before the last one is showing,
+// the last one is given up on (and counted as overlapped).
+class InputLatency
+{
+  public:
+
+    InputLatency(DisplaySegments * display)
+      : _display(display)
+      , _state(StateIdle)
+      , _debounce(0)
+      , _handler(0)
+      , _handledMicros(0)
+      , _drawnMicros(0)
+      , _changes(0)
+      , _count(0)
+      , _unchanged(0)
+      , _overlapped(0)
+      , _max(0)
+    {
+      memset(_stages, 0, sizeof(_stages));
+      memset(_buckets, 0, sizeof(_buckets));
+    }
+
+    void Watch(ButtonPress * button)
+    {
+      button->RegisterHandledHandler(this, &InputLatency::OnHandled);
+    }
+
+    void OnHandled(const ButtonPress & button)
+    {
+      if ( StateIdle != _state )
+      {
+        ++_overlapped;
+      }
+      _state = StateHandled;
+      _handledMicros = Clock::Micros();
+      _handler = button.GetHandlerMicros();
+      _debounce = _handledMicros - _handler - button.GetEdgeMicros();
+      _changes = _display->GetChangeCount();
+    }
+
+    // Called at the end of every pass, after the display has been drawn.  The display keeps the
+    // passes coming while it has anything to send, so we don't need to.
+    void OnPassComplete(unsigned long & delay)
+    {
+      if ( StateHandled == _state )
+      {
+        if ( _display->GetChangeCount() == _changes )
+        {
+          ++_unchanged;
+          _state = StateIdle;
+          return;
+        }
+        _drawnMicros = Clock::Micros();
+        _changes = _display->GetChangeCount();
+        _state = StateDrawn;
+      }
+      if ( ( StateDrawn == _state ) && ( (long)(_display->GetChangesShown() - _changes) >= 0 ) )
+      {
+        unsigned long now = Clock::Micros();
+        Record(StageDebounce, _debounce);
+        Record(StageHandler, _handler);
+        Record(StagePass, _drawnMicros - _handledMicros);
+        Record(StageBus, now - _drawnMicros);
+
+        unsigned long total = _debounce + _handler + (now - _handledMicros);
+        ++_buckets[Bucket(total)];
+        ++_count;
+        if ( total > _max )
+        {
+          _max = total;
+        }
+        _state = StateIdle;
+      }
+    }
+
+    // The percentiles are the top of the bucket they fall in (but never more than the max).
+    unsigned long GetPercentile(uint8_t percent)
+    {
+      unsigned long target = (_count * percent + 99) / 100;
+      unsigned long seen = 0;
+      for ( uint8_t i = 0; i < _bucketCount; ++i )
+      {
+        seen += _buckets[i];
+        if ( ( seen > 0 ) && ( seen >= target ) )
+        {
+          unsigned long top = BucketTop(i);
+          return top < _max ? top : _max;
+        }
+      }
+      return _max;
+    }
+
+    void Report(Print & out)
+    {
+      out.print(F("{\"inputs\":"));
+      out.print(_count);
+      out.print(F(",\"unchanged\":"));
+      out.print(_unchanged);
+      out.print(F(",\"overlapped\":"));
+      out.print(_overlapped);
+      out.print(F(",\"p50_us\":"));
+      out.print(GetPercentile(50));
+      out.print(F(",\"p99_us\":"));
+      out.print(GetPercentile(99));
+      out.print(F(",\"max_us\":"));
+      out.print(_max);
+      ReportStage(out, F("debounce"), _stages[StageDebounce]);
+      ReportStage(out, F("handler"), _stages[StageHandler]);
+      ReportStage(out, F("pass"), _stages[StagePass]);
+      ReportStage(out, F("bus"), _stages[StageBus]);
+      out.println('}');
+    }
+
+  private:
+
+    enum State : uint8_t
+    {
+      StateIdle,
+      StateHandled,
+      StateDrawn
+    };
+
+    enum Stage : uint8_t
+    {
+      StageDebounce,
+      StageHandler,
+      StagePass,
+      StageBus,
+      StageCount
+    };
+
+    struct StageTimes
+    {
+      uint64_t total;
+      unsigned long max;
+    };
+
+    void Record(Stage stage, unsigned long micros)
+    {
+      _stages[stage].total += micros;
+      if ( micros > _stages[stage].max )
+      {
+        _stages[stage].max = micros;
+      }
+    }
+
+    void ReportStage(Print & out, const __FlashStringHelper * name, const StageTimes & times)
+    {
+      out.print(F(",\""));
+      out.print(name);
+      out.print(F("_us\":"));
+      out.print(_count ? (unsigned long)(times.total / _count) : 0UL);
+      out.print(F(",\""));
+      out.print(name);
+      out.print(F("_max_us\":"));
+      out.print(times.max);
+    }
+
+    // Everything under the first bucket's top goes in it, then each doubling after that is split
+    // into four, which keeps the percentiles within about 20% without holding on to every time.
+    static uint8_t Bucket(unsigned long micros)
+    {
+      if ( micros < (4UL << _firstShift) )
+      {
+        return 0;
+      }
+      uint8_t shift = _firstShift;
+      while ( ( micros >> shift ) >= 8 )
+      {
+        ++shift;
+      }
+      unsigned long index = 1 + (shift - _firstShift) * 4 + ( ( micros >> shift ) - 4 );
+      return index < _bucketCount ? index : _bucketCount - 1;
+    }
+
+    static unsigned long BucketTop(uint8_t index)
+    {
+      if ( 0 == index )
+      {
+        return 4UL << _firstShift;
+      }
+      uint8_t shift = _firstShift + (index - 1) / 4;
+      return (5UL + (index - 1) % 4) << shift;
+    }
+
+  private:
+
+    // From 1ms (4 << 8 us) up to about 16s.
+    static const uint8_t _firstShift = 8;
+    static const uint8_t _bucketCount = 1 + 14 * 4;
+
+    DisplaySegments * _display;
+
+    // The press being followed.
+    State _state;
+    unsigned long _debounce;
+    unsigned long _handler;
+    unsigned long _handledMicros;
+    unsigned long _drawnMicros;
+    unsigned long _changes;
+
+    unsigned long _count;
+    unsigned long _unchanged;
+    unsigned long _overlapped;
+    unsigned long _max;
+    StageTimes _stages[StageCount];
+    unsigned long _buckets[_bucketCount];
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+// Keeps track of how close we are to running out of RAM.  The static objects are checked against
+// STATIC_RAM_BUDGET at compile time in the sketch.  The heap and the stack can only be measured
+// while running, so this reports their high water marks (as a line of JSON) every so often.
+// The heap is sampled at the end of every pass, so a worker that allocates and frees within a
+// pass still shows up.  The static RAM reported is what the linker actually laid out (so the
+// core's own globals are in it too), which should only ever be a little over the sketch's sum.
+//
+// To see how deep the stack has ever gone, the free RAM between the heap and the stack is filled
+// with a pattern at startup.  The stack wipes it out as it grows, so whatever is left untouched
+// was never used.  This only works on AVR, where we know the memory layout, so elsewhere the
+// heap and stack are reported as 0 (and the static RAM is the sketch's sum).
+#ifdef __AVR__
+extern char __data_start;
+extern char __heap_start;
+extern char* __brkval;
+#endif
+
+class MemoryReport
+{
+  public:
+
+    MemoryReport(Print & out, unsigned int staticRam, unsigned int budget)
+      : _out(out)
+      , _staticRam(staticRam)
+      , _budget(budget)
+      , _maxHeap(0)
+    {
+    }
+
+    // This should be called first thing in setup() so the stack hasn't gone far yet.
+    void PaintStack()
+    {
+#ifdef __AVR__
+      // Leave some room below where the stack is right now for the call we are in.
+      char* stop = (char*)SP - _paintMargin;
+      for ( char* p = HeapEnd(); p < stop; ++p )
+      {
+        *p = _paint;
+      }
+#endif
+    }
+
+    void PrintObject(const __FlashStringHelper * name, unsigned int size)
+    {
+      _out.print(F("{\"object\":\""));
+      _out.print(name);
+      _out.print(F("\",\"bytes\":"));
+      _out.print(size);
+      _out.println('}');
+    }
+
+    unsigned int GetHeapUsed()
+    {
+#ifdef __AVR__
+      return HeapEnd() - &__heap_start;
+#else
+      return 0;
+#endif
+    }
+
+    unsigned int GetStaticRam()
+    {
+#ifdef __AVR__
+      return &__heap_start - &__data_start;
+#else
+      return _staticRam;
+#endif
+    }
+
+    unsigned int GetStackMax()
+    {
+#ifdef __AVR__
+      // Find the first byte above the heap the stack has ever written over.
+      char* p = HeapEnd();
+      while ( ( p < (char*)SP ) && ( _paint == *p ) )
+      {
+        ++p;
+      }
+      return (char*)RAMEND - p;
+#else
+      return 0;
+#endif
+    }
+
+    // Called at the end of every pass.
+    void SampleHeap(unsigned long & delay)
+    {
+      unsigned int heap = GetHeapUsed();
+      if ( heap > _maxHeap )
+      {
+        _maxHeap = heap;
+      }
+    }
+
+    void Report(unsigned long & delay)
+    {
+      unsigned int staticRam = GetStaticRam();
+      unsigned int stack = GetStackMax();
+      unsigned int total = staticRam + _maxHeap + stack;
+
+      _out.print(F("{\"static\":"));
+      _out.print(staticRam);
+      _out.print(F(",\"heap\":"));
+      _out.print(_maxHeap);
+      _out.print(F(",\"stack\":"));
+      _out.print(stack);
+      _out.print(F(",\"budget\":"));
+      _out.print(_budget);
+      _out.print(F(",\"over\":"));
+      _out.print(total > _budget ? F("true") : F("false"));
+      _out.println('}');
+
+      delay = _reportInterval;
+    }
+
+  private:
+
+#ifdef __AVR__
+    char* HeapEnd()
+    {
+      return __brkval ? __brkval : &__heap_start;
+    }
+#endif
+
+  private:
+
+    static const char _paint = 0xC5;
+    static const unsigned int _paintMargin = 32;
+    static const unsigned long _reportInterval = 10 /*seconds*/ * 1000;
+
+    Print & _out;
+    const unsigned int _staticRam;
+    const unsigned int _budget;
+    unsigned int _maxHeap;
+};
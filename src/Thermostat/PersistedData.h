@@ -1,22 +1,82 @@
 #pragma once
 
 #include <EEPROM.h>
+#include "Clock.h"
 
 class PersistedData
 {
   public:
-    
-    PersistedData()
-      : _storageDirty(0)
+
+    // What each zone's thermostat has learned about how its temp responds to the relay.  The
+    // rates are in hundredths of a degree celsius per minute and zero means not learned yet.
+    struct HeatModel
+    {
+      int16_t rateOn = 0;
+      int16_t rateOff = 0;
+      uint16_t lagSeconds = 0;
+    };
+
+    // Each zone's relay on time per day, in minutes.  The day is 0 for Monday through 6 for
+    // Sunday, or NO_WEEKDAY if the clock hasn't been set since the day began.
+    struct RelayDay
+    {
+      uint16_t todayMinutes = 0;
+      uint16_t yesterdayMinutes = 0;
+      uint16_t elapsedMinutes = 0;
+      uint8_t weekday = NO_WEEKDAY;
+    };
+
+    // Given an image (of IMAGE_SIZE bytes), everything is read from and written to that instead
+    // of the EEPROM.  It starts out as a copy of what is in the EEPROM, so a replay starts from
+    // the board's settings without ever changing (or wearing) them.  On the PC, each of a fleet of
+    // units has its own.  The writes are counted the same either way.
+    PersistedData(uint8_t * image = nullptr)
+      : _image(image)
+      , _storageDirty(false)
+      , _storageChanged(0)
+      , _statsDirty(false)
+      , _statsSaved(Clock::Now())
+      , _eepromWrites(0)
     {
-      EEPROM.get(_address, _storage);
+      if ( _image )
+      {
+        for ( int i = 0; i < IMAGE_SIZE; ++i )
+        {
+          _image[i] = EEPROM.read(_address + i);
+        }
+      }
+      ReplayJournal();
+      Get(_address, _storage);
       if ( ( _storage.sig != _sig) ||
            ( _storage.size != sizeof(_storage) ) )
       {
+        // Anything we don't know the layout of goes back to the defaults, but the settings from
+        // the first release are kept (and saved in the new layout once they are written).
+        StorageFirst first;
+        Get(_address, first);
+        bool upgrade = ( first.sig == _sigFirst ) && ( first.size == sizeof(first) );
+
         _storage.sig = _sig;
         _storage.size = sizeof(_storage);
         _storage.flags = _defaultFlags;
-        _storage.temp = _defaultTemp;
+        for ( uint8_t zone = 0; zone < MAX_ZONES; ++zone )
+        {
+          _storage.temp[zone] = _defaultTemp;
+          _storage.relay[zone].onSeconds = 0;
+          _storage.relay[zone].switches = 0;
+          _storage.day[zone] = RelayDay();
+          _storage.model[zone] = HeatModel();
+        }
+        _storage.scheduleRuns = 0;
+        _storage.watchdogResets = 0;
+        _storage.watchdogWorker = 0;
+
+        if ( upgrade )
+        {
+          _storage.flags = first.flags;
+          _storage.temp[0] = first.temp;
+          MarkDirty();
+        }
       }
     }
 
@@ -28,7 +88,7 @@ class PersistedData
         // Check to make sure our save freq time has elapsed since last change.
         // This ensures that if the user is still changing config that we don't
         // save until they are all done (or at least the normal config timeout is hit).
-        unsigned long elapsed = millis() - _storageDirty;
+        unsigned long elapsed = Clock::Now() - _storageChanged;
         if ( elapsed < _saveFreq )
         {
           // Since the user has changed more recently than our save frequency, lets
@@ -38,14 +98,103 @@ class PersistedData
         }
 
         // Otherwise if we didn't return, we should save the storage and reset the dirty bit.
-        EEPROM.put(_address, _storage);
-        _storageDirty = 0;
+        Save();
+      }
+      else if ( _statsDirty && ( Clock::Now() - _statsSaved >= _statsSaveFreq ) )
+      {
+        // The relay totals and heat models change all the time, so they only get their own
+        // save now and then.
+        Save();
       }
 
       // Now do our normal save frequency check (because we just saved or there wasn't anything to save).
       delay = _saveFreq;
     }
 
+    // Writes the settings that changed since the last save right away, for when the power is
+    // about to go.  There is only time for a few writes, so only the bytes of the settings that
+    // differ are written and the stats are left for their usual save.  More than one byte goes
+    // through the journal first (about twice the writes), so if the power goes part way through
+    // we end up with either all of them or none.
+    void Flush()
+    {
+      if ( !_storageDirty )
+      {
+        return;
+      }
+
+      // If the header isn't there nothing has been saved yet, so there is nothing for the
+      // settings to be a change from and it all has to go.
+      const uint8_t * data = (const uint8_t *)&_storage;
+      for ( uint8_t offset = offsetof(Storage, sig); offset < offsetof(Storage, size) + sizeof(_storage.size); ++offset )
+      {
+        if ( Read(_address + offset) != data[offset] )
+        {
+          Save();
+          return;
+        }
+      }
+
+      // The settings (as opposed to the stats), each as an offset into the storage and a size.
+      static const uint8_t ranges[] PROGMEM =
+      {
+        offsetof(Storage, flags), sizeof(_storage.flags),
+        offsetof(Storage, temp), sizeof(_storage.temp),
+        offsetof(Storage, scheduleRuns), sizeof(_storage.scheduleRuns),
+        offsetof(Storage, schedule), sizeof(_storage.schedule),
+      };
+
+      // Each byte that differs goes straight into the journal, except that the first is held back
+      // in case it is the only one.  A single byte is written as it is, there is nothing for it to
+      // be torn from.
+      JournalEntry first;
+      uint8_t count = 0;
+      uint8_t check = 0;
+      for ( uint8_t range = 0; range < sizeof(ranges); range += 2 )
+      {
+        uint8_t end = pgm_read_byte(&ranges[range]) + pgm_read_byte(&ranges[range + 1]);
+        for ( uint8_t offset = pgm_read_byte(&ranges[range]); offset < end; ++offset )
+        {
+          if ( Read(_address + offset) != data[offset] )
+          {
+            JournalEntry entry = { offset, data[offset] };
+            if ( 0 == count )
+            {
+              first = entry;
+            }
+            else
+            {
+              if ( 1 == count )
+              {
+                check = Journal(0, first, check);
+              }
+              check = Journal(count, entry, check);
+            }
+            ++count;
+          }
+        }
+      }
+
+      if ( 1 == count )
+      {
+        Update(_address + first.offset, first.value);
+      }
+      else if ( count > 1 )
+      {
+        // The check and then the count, which is what makes them count.
+        Update(_journalAddress + 1, JournalCheck(check, count));
+        Update(_journalAddress, count);
+        ApplyJournal(count);
+      }
+      _storageDirty = false;
+    }
+
+    // How many bytes have actually been written, to see how hard the EEPROM is being worked.
+    unsigned long GetEepromWrites()
+    {
+      return _eepromWrites;
+    }
+
     uint8_t get_LedBrigtness()
     {
       return (_storage.flags & MASK_BRIGHTNESS_VALUE);
@@ -56,7 +205,7 @@ class PersistedData
       if ( get_LedBrigtness() != (led & MASK_BRIGHTNESS_VALUE) )
       {
         _storage.flags = (_storage.flags & ~MASK_BRIGHTNESS_VALUE) | (led & MASK_BRIGHTNESS_VALUE);
-        _storageDirty = millis();
+        MarkDirty();
       }
     }
 
@@ -80,22 +229,258 @@ class PersistedData
       set_flag(enabled, FLAG_CELSIUS);
     }
 
-    uint8_t get_ThermostatTemp()
+    uint8_t get_ThermostatTemp(uint8_t zone = 0)
+    {
+      return _storage.temp[zone];
+    }
+
+    void set_ThermostatTemp(uint8_t temp, uint8_t zone = 0)
+    {
+      if ( _storage.temp[zone] != temp )
+      {
+        _storage.temp[zone] = temp;
+        MarkDirty();
+      }
+    }
+
+    unsigned long get_RelayOnSeconds(uint8_t zone = 0)
+    {
+      return _storage.relay[zone].onSeconds;
+    }
+
+    unsigned long get_RelaySwitches(uint8_t zone = 0)
+    {
+      return _storage.relay[zone].switches;
+    }
+
+    void set_RelayTotals(unsigned long onSeconds, unsigned long switches, uint8_t zone = 0)
+    {
+      if ( ( _storage.relay[zone].onSeconds != onSeconds ) ||
+           ( _storage.relay[zone].switches != switches ) )
+      {
+        _storage.relay[zone].onSeconds = onSeconds;
+        _storage.relay[zone].switches = switches;
+        _statsDirty = true;
+      }
+    }
+
+    RelayDay get_RelayDay(uint8_t zone = 0)
+    {
+      return _storage.day[zone];
+    }
+
+    void set_RelayDay(const RelayDay & day, uint8_t zone = 0)
+    {
+      if ( memcmp(&_storage.day[zone], &day, sizeof(day)) )
+      {
+        _storage.day[zone] = day;
+        _statsDirty = true;
+      }
+    }
+
+    HeatModel get_HeatModel(uint8_t zone = 0)
+    {
+      return _storage.model[zone];
+    }
+
+    void set_HeatModel(const HeatModel & model, uint8_t zone = 0)
+    {
+      if ( memcmp(&_storage.model[zone], &model, sizeof(model)) )
+      {
+        _storage.model[zone] = model;
+        _statsDirty = true;
+      }
+    }
+
+    // The weekly schedule is kept as a list of runs, see WeeklySchedule for how they're packed.
+    uint8_t get_ScheduleRuns()
+    {
+      return _storage.scheduleRuns;
+    }
+
+    uint16_t get_ScheduleRun(uint8_t run)
+    {
+      return _storage.schedule[run];
+    }
+
+    void set_Schedule(const uint16_t * runs, uint8_t count)
+    {
+      if ( ( _storage.scheduleRuns != count ) || memcmp(_storage.schedule, runs, count * sizeof(runs[0])) )
+      {
+        _storage.scheduleRuns = count;
+        memcpy(_storage.schedule, runs, count * sizeof(runs[0]));
+        MarkDirty();
+      }
+    }
+
+    uint8_t get_WatchdogResets()
+    {
+      return _storage.watchdogResets;
+    }
+
+    uint8_t get_WatchdogWorker()
     {
-      return _storage.temp;
+      return _storage.watchdogWorker;
     }
 
-    void set_ThermostatTemp(uint8_t temp)
+    // This is rare (and we want it even if we reset again soon), so it is saved right away.
+    void RecordWatchdogReset(uint8_t worker)
     {
-      if ( _storage.temp != temp )
+      if ( _storage.watchdogResets < 0xFF )
       {
-        _storage.temp = temp;
-        _storageDirty = millis();
+        ++_storage.watchdogResets;
       }
+      _storage.watchdogWorker = worker;
+      Put(_address, _storage);
     }
 
+  public:
+
+    // Each zone only costs a single byte of storage for its trigger temp (in fahrenheit).
+    static const uint8_t MAX_ZONES = 4;
+
+    // Each run of the schedule costs 2 bytes.
+    static const uint8_t MAX_SCHEDULE_RUNS = 16;
+
+    static const uint8_t NO_WEEKDAY = 0xFF;
+
   private:
 
+    void Save()
+    {
+      // Only the bytes that changed are written, so the parts of the totals that change
+      // slowly (like the high bytes) wear much less than the rest.
+      Put(_address, _storage);
+      _storageDirty = false;
+      _statsDirty = false;
+      _statsSaved = Clock::Now();
+    }
+
+    // Every write goes through these so they can be counted.  Like EEPROM.put, only the bytes
+    // that changed are written.
+    template <typename T>
+    void Put(int address, const T & value)
+    {
+      const uint8_t * bytes = (const uint8_t *)&value;
+      for ( size_t i = 0; i < sizeof(T); ++i )
+      {
+        Update(address + i, bytes[i]);
+      }
+    }
+
+    void Update(int address, uint8_t value)
+    {
+      if ( Read(address) != value )
+      {
+        if ( _image )
+        {
+          _image[address - _address] = value;
+        }
+        else
+        {
+          EEPROM.write(address, value);
+        }
+        ++_eepromWrites;
+      }
+    }
+
+    uint8_t Read(int address)
+    {
+      return _image ? _image[address - _address] : EEPROM.read(address);
+    }
+
+    template <typename T>
+    void Get(int address, T & value)
+    {
+      uint8_t * bytes = (uint8_t *)&value;
+      for ( size_t i = 0; i < sizeof(T); ++i )
+      {
+        bytes[i] = Read(address + i);
+      }
+    }
+
+    struct JournalEntry
+    {
+      uint8_t offset;
+      uint8_t value;
+    };
+
+    // Writes an entry into the journal and adds it to the check.
+    uint8_t Journal(uint8_t index, const JournalEntry & entry, uint8_t check)
+    {
+      Put(JournalEntryAddress(index), entry);
+      return JournalStep(check, entry);
+    }
+
+    // If the power went while a journal was being applied, finish applying it.
+    void ReplayJournal()
+    {
+      // Only this layout leaves a journal where this one looks for it, so one found behind any
+      // other header isn't ours to apply.
+      int sig;
+      size_t size;
+      Get(_address + offsetof(Storage, sig), sig);
+      Get(_address + offsetof(Storage, size), size);
+      if ( ( sig != _sig ) || ( size != sizeof(Storage) ) )
+      {
+        return;
+      }
+
+      uint8_t count = Read(_journalAddress);
+      if ( ( count < 2 ) || ( count > _journalEntries ) )
+      {
+        return;
+      }
+      uint8_t check = 0;
+      for ( uint8_t i = 0; i < count; ++i )
+      {
+        JournalEntry entry;
+        Get(JournalEntryAddress(i), entry);
+        check = JournalStep(check, entry);
+      }
+      if ( Read(_journalAddress + 1) == JournalCheck(check, count) )
+      {
+        ApplyJournal(count);
+      }
+      else
+      {
+        Update(_journalAddress, 0);
+      }
+    }
+
+    void ApplyJournal(uint8_t count)
+    {
+      for ( uint8_t i = 0; i < count; ++i )
+      {
+        JournalEntry entry;
+        Get(JournalEntryAddress(i), entry);
+        Update(_address + entry.offset, entry.value);
+      }
+      Update(_journalAddress, 0);
+    }
+
+    static int JournalEntryAddress(uint8_t index)
+    {
+      return _journalAddress + _journalHeader + index * sizeof(JournalEntry);
+    }
+
+    // The check is built up an entry at a time, with the count folded in last.
+    static uint8_t JournalStep(uint8_t check, const JournalEntry & entry)
+    {
+      return (check << 1 | check >> 7) ^ entry.offset ^ entry.value;
+    }
+
+    static uint8_t JournalCheck(uint8_t check, uint8_t count)
+    {
+      return (check << 1 | check >> 7) ^ count;
+    }
+
+    void MarkDirty()
+    {
+      _storageDirty = true;
+      _storageChanged = Clock::Now();
+    }
+
     bool get_flag(uint8_t flag)
     {
       return (flag == (_storage.flags & flag));
@@ -113,18 +498,24 @@ class PersistedData
         {
           _storage.flags &= ~flag;
         }
-        EEPROM.put(_address, _storage);
+        Put(_address, _storage);
       }
     }
 
   private:
     static const int _address = 0;
-    static const int _sig = 0x04281976;
+
+    // Changed whenever the layout of the storage does, so an older one is never read as this one.
+    static const int _sig = 0x04281977;
 
     // Generally it is a good idea to keep this the same as the _configTimeOut in HeadDisplay
     // so we try to save the settings just after the config times out and is "finished".
     static const unsigned long _saveFreq = 5 /*seconds*/ * 1000;
 
+    // An EEPROM cell is good for about 100,000 writes, so saving the stats once an hour keeps
+    // even the busiest byte going for over 10 years.  At worst we lose the last hour on a reboot.
+    static const unsigned long _statsSaveFreq = 60 /*minutes*/ * 60UL * 1000;
+
     static const uint8_t MASK_BRIGHTNESS_VALUE  = 0x07;
     static const uint8_t FLAG_BRIGHTNESS_ON     = 0x08;
     static const uint8_t FLAG_CELSIUS           = 0x10;
@@ -132,7 +523,16 @@ class PersistedData
     static const uint8_t _defaultFlags = MASK_BRIGHTNESS_VALUE /*DisplaySegments::Brightness::LedMax*/ | FLAG_BRIGHTNESS_ON | FLAG_CELSIUS;
     static const uint8_t _defaultTemp = 86; // degree F
     
-    struct Storage
+    struct RelayTotals
+    {
+      uint32_t onSeconds;
+      uint32_t switches;
+    };
+
+    // The first release only had the one zone's settings.
+    static const int _sigFirst = 0x04281976;
+
+    struct StorageFirst
     {
       int sig;
       size_t size;
@@ -140,6 +540,43 @@ class PersistedData
       uint8_t temp;
     };
 
+    struct Storage
+    {
+      int sig;
+      size_t size;
+      uint8_t flags;
+      uint8_t temp[MAX_ZONES];
+      RelayTotals relay[MAX_ZONES];
+      RelayDay day[MAX_ZONES];
+      HeatModel model[MAX_ZONES];
+      uint8_t scheduleRuns;
+      uint16_t schedule[MAX_SCHEDULE_RUNS];
+      uint8_t watchdogResets;
+      uint8_t watchdogWorker;
+    };
+
+    // The journal goes right after the storage, a count and check byte and then the entries.
+    // There is room for every byte of the settings, so they all go in together.
+    static const int _journalAddress = _address + sizeof(Storage);
+    static const uint8_t _journalHeader = 2;
+    static const uint8_t _journalEntries = sizeof(Storage::flags) + sizeof(Storage::temp) + sizeof(Storage::scheduleRuns) + sizeof(Storage::schedule);
+    static_assert(sizeof(Storage) <= 0xFF, "The journal offsets are only a byte");
+
+  public:
+
+    // How much of the EEPROM is used, the storage and then the journal.
+    static const int IMAGE_SIZE = _journalAddress + _journalHeader + _journalEntries * sizeof(JournalEntry) - _address;
+
+  private:
+
+    uint8_t * _image;
     Storage _storage;
-    unsigned long _storageDirty;
+    // A flag rather than 0 for clean, since 0 is a perfectly good time (right after boot and
+    // whenever the time wraps).
+    bool _storageDirty;
+    unsigned long _storageChanged;
+    bool _statsDirty;
+    unsigned long _statsSaved;
+    unsigned long _eepromWrites;
 };
+
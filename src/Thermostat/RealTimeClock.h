@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Clock.h"
+
+// A software clock for the time of the week, counted on from whenever it was last set (over the
+// serial port).  There is no battery backed clock, so it needs setting again after power is lost.
+// Only the day of the week and time of day matter for the schedule, so that is all it keeps.
+class RealTimeClock
+{
+  public:
+
+    RealTimeClock()
+      : _set(false)
+      , _setAt(0)
+      , _weekSecondsAtSet(0)
+    {
+    }
+
+    // The day is 0 for Monday through 6 for Sunday.
+    bool Set(uint8_t day, uint8_t hour, uint8_t minute, uint8_t second = 0)
+    {
+      if ( ( day >= 7 ) || ( hour >= 24 ) || ( minute >= 60 ) || ( second >= 60 ) )
+      {
+        return false;
+      }
+      _setAt = Clock::Now64();
+      _weekSecondsAtSet = ((day * 24UL + hour) * 60 + minute) * 60 + second;
+      _set = true;
+      return true;
+    }
+
+    bool IsSet()
+    {
+      return _set;
+    }
+
+    // Seconds since Monday 00:00.
+    unsigned long GetWeekSeconds()
+    {
+      // The 64 bit time never wraps, so we can always count from when we were set.
+      unsigned long seconds = (Clock::Now64() - _setAt) / 1000 % SECONDS_PER_WEEK;
+      return (_weekSecondsAtSet + seconds) % SECONDS_PER_WEEK;
+    }
+
+    void PrintTime(Print & out)
+    {
+      unsigned long seconds = GetWeekSeconds();
+      out.print(seconds / _secondsPerDay);
+      out.print(' ');
+      PrintTwoDigits(out, seconds / 3600 % 24);
+      out.print(':');
+      PrintTwoDigits(out, seconds / 60 % 60);
+      out.print(':');
+      PrintTwoDigits(out, seconds % 60);
+    }
+
+    static void PrintTwoDigits(Print & out, uint8_t value)
+    {
+      if ( value < 10 )
+      {
+        out.print('0');
+      }
+      out.print(value);
+    }
+
+  public:
+
+    static const unsigned long SECONDS_PER_WEEK = 7 * 24UL * 60 * 60;
+
+  private:
+
+    static const unsigned long _secondsPerDay = 24UL * 60 * 60;
+
+    bool _set;
+    uint64_t _setAt;
+    unsigned long _weekSecondsAtSet;
+};
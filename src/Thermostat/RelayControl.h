@@ -1,26 +1,214 @@
 #pragma once
 
+#include "EventBus.h"
+#include "PersistedData.h"
+#include "RealTimeClock.h"
+#include "Clock.h"
+
+// Besides switching the relay, this keeps track of how long it has been on and how often it
+// has switched, so we can tell how hard each zone's heater is working.  The totals carry on
+// across reboots through the persisted data.  The on time is also rolled up per day (today so
+// far and all of yesterday), which only needs the time since the last update, so it is the same
+// small amount of work however long the relay has been running.  The days start at midnight
+// once the clock has been set, until then they are just 24 hours at a time.
 class RelayControl
 {
   public:
 
-    RelayControl(int pinOut)
+    RelayControl(int pinOut, PersistedData * storage, uint8_t zone = 0)
       : _pin(pinOut)
+      , _storage(storage)
+      , _zone(zone)
+      , _on(false)
+      , _lastUpdate(Clock::Now())
+      , _onMillis(0)
+      , _onSeconds(storage->get_RelayOnSeconds(zone))
+      , _switches(storage->get_RelaySwitches(zone))
+      , _rtc(NULL)
     {
+      // Carry on with the day where we left off (as of the last save).
+      PersistedData::RelayDay day = storage->get_RelayDay(zone);
+      _dayElapsed = day.elapsedMinutes * _msPerMinute;
+      _todayOn = day.todayMinutes * _msPerMinute;
+      _yesterdayOn = day.yesterdayMinutes * _msPerMinute;
+      _weekday = day.weekday;
       pinMode(pinOut, OUTPUT);
     }
 
+    // The clock the days roll over by, once it is set.
+    void SetClock(RealTimeClock * rtc)
+    {
+      _rtc = rtc;
+    }
+
     virtual ~RelayControl()
     {
     }
 
     void ChangeState(bool enabled)
     {
+      Accumulate();
+      if ( enabled != _on )
+      {
+        _on = enabled;
+        ++_switches;
+      }
+      digitalWrite(_pin, enabled ? HIGH : LOW);
+    }
+
+    // Puts the relay back how it was before a reset.  As far as the heater is concerned it
+    // never changed, so it isn't counted as a switch.
+    void Restore(bool enabled)
+    {
+      Accumulate();
+      _on = enabled;
       digitalWrite(_pin, enabled ? HIGH : LOW);
     }
 
+    void OnRelayEvent(const Event & event)
+    {
+      ChangeState(event.value);
+    }
+
+    // Brings the totals up to date and hands them to the persisted data.  That only writes them
+    // out every so often, this just makes sure the latest is there when it does.
+    void UpdateStats(unsigned long & delay)
+    {
+      Accumulate();
+      _storage->set_RelayTotals(_onSeconds, _switches, _zone);
+
+      PersistedData::RelayDay day;
+      day.todayMinutes = _todayOn / _msPerMinute;
+      day.yesterdayMinutes = _yesterdayOn / _msPerMinute;
+      day.elapsedMinutes = _dayElapsed / _msPerMinute;
+      day.weekday = _weekday;
+      _storage->set_RelayDay(day, _zone);
+      delay = UPDATE_INTERVAL;
+    }
+
+    bool IsOn()
+    {
+      return _on;
+    }
+
+    unsigned long GetOnSeconds()
+    {
+      return _onSeconds;
+    }
+
+    unsigned long GetSwitches()
+    {
+      return _switches;
+    }
+
+    unsigned long GetOnMinutesToday()
+    {
+      return _todayOn / _msPerMinute;
+    }
+
+    unsigned long GetOnMinutesYesterday()
+    {
+      return _yesterdayOn / _msPerMinute;
+    }
+
+    // The percent of the day so far that the relay has been on.
+    uint8_t GetDutyToday()
+    {
+      // Scale the elapsed time down rather than the on time up, so it can't overflow.
+      unsigned long hundredth = _dayElapsed / 100;
+      return hundredth ? _todayOn / hundredth : 0;
+    }
+
   private:
 
+    void Accumulate()
+    {
+      unsigned long now = Clock::Now();
+      unsigned long elapsed = now - _lastUpdate;
+      _lastUpdate = now;
+
+      _dayElapsed += elapsed;
+      if ( _on )
+      {
+        _onMillis += elapsed;
+        _todayOn += elapsed;
+        _onSeconds += _onMillis / 1000;
+        _onMillis %= 1000;
+      }
+
+      if ( _rtc && _rtc->IsSet() )
+      {
+        unsigned long weekSeconds = _rtc->GetWeekSeconds();
+        uint8_t weekday = weekSeconds / _secondsPerDay;
+        unsigned long sinceMidnight = weekSeconds % _secondsPerDay * 1000;
+        if ( weekday != _weekday )
+        {
+          // Whatever ran on past midnight belongs to the new day.  If we didn't see the day
+          // before through (we were off, or the clock was set to another day) we can't say how
+          // long it was on.  Unless we didn't know the day at all, then today is our best guess.
+          unsigned long carried = _on ? ( sinceMidnight < _todayOn ? sinceMidnight : _todayOn ) : 0;
+          if ( _weekday == ( weekday + 6 ) % 7 )
+          {
+            _yesterdayOn = _todayOn - carried;
+            _todayOn = carried;
+          }
+          else if ( _weekday != PersistedData::NO_WEEKDAY )
+          {
+            _yesterdayOn = 0;
+            _todayOn = carried;
+          }
+          _weekday = weekday;
+        }
+        // The day can't have had more on time than it has had time (the clock may have just
+        // been set to earlier in the day).
+        if ( _todayOn > sinceMidnight )
+        {
+          _todayOn = sinceMidnight;
+        }
+        _dayElapsed = sinceMidnight;
+      }
+      else if ( _dayElapsed >= _msPerDay )
+      {
+        // Whatever ran on past the end of the day belongs to the new one.
+        unsigned long overrun = _dayElapsed - _msPerDay;
+        unsigned long carried = _on ? ( overrun < _todayOn ? overrun : _todayOn ) : 0;
+        _yesterdayOn = _todayOn - carried;
+        _todayOn = carried;
+        _dayElapsed = overrun;
+        // If the clock was set before a reboot, we came back near where that day was, so this
+        // is about when the next one starts.
+        if ( _weekday != PersistedData::NO_WEEKDAY )
+        {
+          _weekday = ( _weekday + 1 ) % 7;
+        }
+      }
+    }
+
+  public:
+
+    static const unsigned long UPDATE_INTERVAL = 1 /*minutes*/ * 60 * 1000;
+
+  private:
+
+    static const unsigned long _msPerMinute = 60UL * 1000;
+    static const unsigned long _msPerDay = 24UL * 60 * 60 * 1000;
+    static const unsigned long _secondsPerDay = 24UL * 60 * 60;
+
     const int _pin;
-};
+    PersistedData * _storage;
+    const uint8_t _zone;
+    bool _on;
 
+    // The running totals, the ms that don't yet make a full second are kept separately.
+    unsigned long _lastUpdate;
+    unsigned long _onMillis;
+    unsigned long _onSeconds;
+    unsigned long _switches;
+
+    // The per day rollups (all in ms), and which day today is if we know.
+    unsigned long _dayElapsed;
+    unsigned long _todayOn;
+    unsigned long _yesterdayOn;
+    uint8_t _weekday;
+    RealTimeClock * _rtc;
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "RealTimeClock.h"
+#include "WeeklySchedule.h"
+
+// Simple line based commands over the serial port to set the clock and the weekly schedule.
+// Days are 0 for Monday through 6 for Sunday and setbacks are in whole degrees fahrenheit.
+//
+//   T <day> <hh>:<mm>             set the clock
+//   A <day> <hh>:<mm> <setback>   from then on move the trigger by the setback
+//   C                             clear the schedule
+//   P                             print the clock and the schedule
+//
+// The input is picked up a bit at a time as it arrives, so it never holds up the loop.
+class SerialControl
+{
+  public:
+
+    SerialControl(Stream & io, RealTimeClock * clock, WeeklySchedule * schedule)
+      : _io(io)
+      , _clock(clock)
+      , _schedule(schedule)
+      , _length(0)
+    {
+    }
+
+    void CheckInput(unsigned long & delay)
+    {
+      while ( _io.available() > 0 )
+      {
+        char c = _io.read();
+        if ( ( '\n' == c ) || ( '\r' == c ) )
+        {
+          if ( _length > 0 )
+          {
+            _line[_length] = '\0';
+            _io.println(Execute() ? F("ok") : F("error"));
+            _length = 0;
+          }
+        }
+        else if ( _length < sizeof(_line) - 1 )
+        {
+          _line[_length++] = c;
+        }
+      }
+      delay = _pollInterval;
+    }
+
+  private:
+
+    bool Execute()
+    {
+      const char * next = _line + 1;
+      int day;
+      int hour;
+      int minute;
+      int setback;
+      switch ( _line[0] )
+      {
+        case 'T':
+          if ( ParseNumber(next, day) && ParseNumber(next, hour) && ParseNumber(next, minute) &&
+               _clock->Set(day, hour, minute) )
+          {
+            _schedule->Refresh();
+            return true;
+          }
+          return false;
+
+        case 'A':
+          return ParseNumber(next, day) && ParseNumber(next, hour) && ParseNumber(next, minute) && ParseNumber(next, setback) &&
+                 _schedule->AddTransition(day, hour, minute, setback);
+
+        case 'C':
+          _schedule->Clear();
+          return true;
+
+        case 'P':
+          if ( _clock->IsSet() )
+          {
+            _clock->PrintTime(_io);
+            _io.println();
+          }
+          _schedule->PrintRuns(_io);
+          return true;
+      }
+      return false;
+    }
+
+    // Skips anything that can't start a number (like the spaces and the colon), then reads it.
+    static bool ParseNumber(const char * & text, int & value)
+    {
+      while ( *text && ( '-' != *text ) && !isDigit(*text) )
+      {
+        ++text;
+      }
+      bool negative = ( '-' == *text );
+      if ( negative )
+      {
+        ++text;
+      }
+      if ( !isDigit(*text) )
+      {
+        return false;
+      }
+      value = 0;
+      while ( isDigit(*text) )
+      {
+        value = value * 10 + (*text++ - '0');
+      }
+      if ( negative )
+      {
+        value = -value;
+      }
+      return true;
+    }
+
+  private:
+
+    static const unsigned long _pollInterval = 50 /*ms*/;
+
+    Stream & _io;
+    RealTimeClock * _clock;
+    WeeklySchedule * _schedule;
+    char _line[24];
+    uint8_t _length;
+};
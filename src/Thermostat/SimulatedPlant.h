@@ -0,0 +1,132 @@
+#pragma once
+
+#include "SimulatedSensor.h"
+#include "RelayControl.h"
+#include "Thermostat.h"
+
+// A space for a zone's relay to cool, so the firmware can be run on the virtual clock against
+// something that answers back rather than recorded temps.  A steady source warms the space, and
+// while the relay is on it chills a coil that cools the space.  The coil takes a while to chill
+// and to warm back up, so like a real one the temp carries on past the trigger for a bit after
+// each switch.  Each step hands the temp to the zone's sensor and keeps track of how well the
+// zone is being run.
+//
+// The temps are kept in ten thousandths of a degree celsius, so even the slow rates move them
+// every step.  The time constants are how many seconds it takes to close a gap between two temps.
+class SimulatedPlant
+{
+  public:
+
+    SimulatedPlant(SimulatedSensor * sensor, RelayControl * relay, Thermostat * thermostat,
+                   int startCelsius = _defaultStartCelsius, int sourceCelsius = _defaultSourceCelsius,
+                   int coilCelsius = _defaultCoilCelsius, long sourceTime = _defaultSourceTime,
+                   long coilTime = _defaultCoilTime, long roomTime = _defaultRoomTime)
+      : _sensor(sensor)
+      , _relay(relay)
+      , _thermostat(thermostat)
+      , _room(startCelsius * _perDegree)
+      , _coil(startCelsius * _perDegree)
+      , _source(sourceCelsius * _perDegree)
+      , _coilCold(coilCelsius * _perDegree)
+      , _sourceTime(sourceTime)
+      , _coilTime(coilTime)
+      , _roomTime(roomTime)
+      , _reachedTrigger(false)
+      , _maxOver(0)
+      , _maxUnder(0)
+    {
+      _sensor->Reset(startCelsius);
+    }
+
+    void Step(unsigned long & delay)
+    {
+      // With the relay off the coil just drifts back to the room temp.
+      long toCoil = (_room - _coil) / _roomTime;
+      _coil += ( (_relay->IsOn() ? _coilCold : _room) - _coil ) / _coilTime;
+      _room += (_source - _room) / _sourceTime - toCoil;
+      _sensor->SetTemp((_room + _perDegree / 2) / _perDegree);
+
+      // Only once it has warmed up to the trigger does falling short of it count.  The sensor only
+      // reads whole degrees, so getting within half a degree is as close as it can tell.
+      long fromTrigger = (_room - (long)_thermostat->GetTriggerTemp(true) * _perDegree) / _perHundredth;
+      _reachedTrigger = _reachedTrigger || ( fromTrigger >= -50 /*hundredths*/ );
+      if ( fromTrigger > _maxOver )
+      {
+        _maxOver = fromTrigger;
+      }
+      if ( _reachedTrigger && ( -fromTrigger > _maxUnder ) )
+      {
+        _maxUnder = -fromTrigger;
+      }
+      delay = _stepInterval;
+    }
+
+    // The temp in hundredths of a degree celsius.
+    long GetRoomTemp()
+    {
+      return _room / _perHundredth;
+    }
+
+    // How far (in hundredths of a degree) the temp has gone over the trigger temp, and under it
+    // once it first got there.
+    long GetMaxOvershoot()
+    {
+      return _maxOver;
+    }
+
+    long GetMaxUndershoot()
+    {
+      return _maxUnder;
+    }
+
+    void Report(Print & out)
+    {
+      out.print(F("{\"zone\":"));
+      out.print(_thermostat->GetZone());
+      out.print(F(",\"room\":"));
+      out.print(GetRoomTemp());
+      out.print(F(",\"switches\":"));
+      out.print(_relay->GetSwitches());
+      out.print(F(",\"on_s\":"));
+      out.print(_relay->GetOnSeconds());
+      out.print(F(",\"overshoot\":"));
+      out.print(_maxOver);
+      out.print(F(",\"undershoot\":"));
+      out.print(_maxUnder);
+      out.print(F(",\"reads\":"));
+      out.print(_thermostat->GetReads());
+      out.println('}');
+    }
+
+  private:
+
+    static const long _perDegree = 10000;
+    static const long _perHundredth = _perDegree / 100;
+    static const unsigned long _stepInterval = 1 /*second*/ * 1000;
+
+    // Around the default trigger (30 degrees) the source warms it about 0.1 degree a minute and
+    // the coil (once it has chilled, in a few minutes) cools it about twice that fast.  So the
+    // relay is on about a third of the time.
+    static const int _defaultStartCelsius = 20;
+    static const int _defaultSourceCelsius = 45;
+    static const int _defaultCoilCelsius = 5;
+    static const long _defaultSourceTime = 7200;
+    static const long _defaultCoilTime = 120;
+    static const long _defaultRoomTime = 4000;
+
+    SimulatedSensor * _sensor;
+    RelayControl * _relay;
+    Thermostat * _thermostat;
+
+    long _room;
+    long _coil;
+    const long _source;
+    const long _coilCold;
+    const long _sourceTime;
+    const long _coilTime;
+    const long _roomTime;
+
+    bool _reachedTrigger;
+    long _maxOver;
+    long _maxUnder;
+};
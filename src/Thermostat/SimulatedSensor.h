@@ -0,0 +1,90 @@
+#pragma once
+
+#include "TempSensor.h"
+
+// A sensor with no hardware behind it.  Whatever temp (or error code) is set is what the next
+// conversion returns, after the given conversion time, so host tests can drive a Thermostat.
+class SimulatedSensor : public TempSensor
+{
+  public:
+
+    SimulatedSensor(int tempCelsius = 20, unsigned long conversionTime = 0)
+      : _tempCelsius(tempCelsius)
+      , _conversionTime(conversionTime)
+      , _conversions(0)
+      , _readCost(0)
+      , _pending(false)
+      , _waitForTemp(false)
+    {
+    }
+
+    // When set, a conversion isn't finished till a new temp has been set, so the readings
+    // happen exactly when whoever is setting them (like a trace replay) wants them to.
+    void SetWaitForTemp(bool wait)
+    {
+      _waitForTemp = wait;
+    }
+
+    // How long (in us) each read blocks for, like a bit-banged read of a real sensor (a DHT11 takes
+    // about 25ms) would hold up everything else in the pass.
+    void SetReadCost(unsigned long cost)
+    {
+      _readCost = cost;
+    }
+
+    void SetTemp(int tempCelsius)
+    {
+      _tempCelsius = tempCelsius;
+      _pending = true;
+    }
+
+    // Sets the temp without it counting as a new reading.
+    void Reset(int tempCelsius)
+    {
+      _tempCelsius = tempCelsius;
+      _pending = false;
+    }
+
+    // Whether the last temp set hasn't been read by a conversion yet.
+    bool IsPending()
+    {
+      return _pending;
+    }
+
+    unsigned long GetConversions()
+    {
+      return _conversions;
+    }
+
+    virtual unsigned long StartConversion()
+    {
+      ++_conversions;
+      return _conversionTime;
+    }
+
+    virtual bool PollResult(int & tempCelsius, unsigned long & delay)
+    {
+      if ( _waitForTemp && !_pending )
+      {
+        delay = _waitInterval;
+        return false;
+      }
+      // Split up, since delayMicroseconds() is only good for up to 16ms.
+      ::delay(_readCost / 1000);
+      delayMicroseconds(_readCost % 1000);
+      tempCelsius = _tempCelsius;
+      _pending = false;
+      return true;
+    }
+
+  private:
+
+    static const unsigned long _waitInterval = 1 /*ms*/;
+
+    int _tempCelsius;
+    const unsigned long _conversionTime;
+    unsigned long _conversions;
+    unsigned long _readCost;
+    bool _pending;
+    bool _waitForTemp;
+};
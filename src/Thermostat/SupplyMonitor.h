@@ -0,0 +1,135 @@
+#pragma once
+
+#include "ArduinoHandler.h"
+
+// Watches the supply voltage, so the settings that haven't been saved yet can be written out as
+// soon as it starts to sag rather than being lost with the power.  It doesn't need a pin, since
+// the internal 1.1V bandgap is measured against the supply instead (the lower the supply, the
+// higher the reading).  That is only wired up for the ATmega328P, anywhere else the supply always
+// looks fine unless it is simulated (like in a trace replay).
+class SupplyMonitor
+{
+  public:
+
+    // The bandgap is nominally 1.1V, but each chip's own (as measured on AREF) makes it accurate.
+    SupplyMonitor(unsigned int lowMillivolts, unsigned int bandgapMillivolts = 1100)
+      : _lowMillivolts(lowMillivolts)
+      , _bandgapMillivolts(bandgapMillivolts)
+      , _millivolts(NOMINAL_MILLIVOLTS)
+      , _low(false)
+      , _lowCount(0)
+      , _simulated(false)
+      , _simulatedMillivolts(NOMINAL_MILLIVOLTS)
+    {
+    }
+
+    // Called once when the supply drops below the low level.  It isn't called again till the
+    // supply has come back up a good way past it.
+    template <typename T>
+    void RegisterLowHandler(T* obj, void (T::*method)())
+    {
+      _handlerLow.Register(obj, method);
+    }
+
+    void CheckSupply(unsigned long & delay)
+    {
+      delay = _checkInterval;
+      if ( !Measure() )
+      {
+        return;
+      }
+      if ( !_low && ( _millivolts < _lowMillivolts ) )
+      {
+        _low = true;
+        ++_lowCount;
+        _handlerLow.Invoke();
+      }
+      else if ( _low && ( _millivolts >= _lowMillivolts + _hysteresis ) )
+      {
+        _low = false;
+      }
+    }
+
+    bool IsLow()
+    {
+      return _low;
+    }
+
+    unsigned int GetMillivolts()
+    {
+      return _millivolts;
+    }
+
+    unsigned long GetLowCount()
+    {
+      return _lowCount;
+    }
+
+    // From now on the supply is whatever is set here rather than what is measured.
+    void SetSimulatedMillivolts(unsigned int millivolts)
+    {
+      _simulated = true;
+      _simulatedMillivolts = millivolts;
+    }
+
+  private:
+
+    // Returns false if there is no new reading this time.
+    bool Measure()
+    {
+      if ( _simulated )
+      {
+        _millivolts = _simulatedMillivolts;
+        return true;
+      }
+#ifdef __AVR_ATmega328P__
+      // Anything else using the ADC (like analogRead) moves the mux.  Once it is moved back to the
+      // bandgap it needs a while to settle, so rather than wait here the reading is left for the
+      // next check.  Otherwise it is a single conversion of about 100us.
+      if ( _bandgapMux != ADMUX )
+      {
+        ADMUX = _bandgapMux;
+        return false;
+      }
+      ADCSRA |= _BV(ADSC);
+      while ( bit_is_set(ADCSRA, ADSC) )
+      {
+      }
+      uint16_t reading = ADC;
+      if ( reading )
+      {
+        _millivolts = (unsigned long)_bandgapMillivolts * 1023 / reading;
+      }
+      return true;
+#else
+      return false;
+#endif
+    }
+
+  public:
+
+    static const unsigned int NOMINAL_MILLIVOLTS = 5000;
+
+  private:
+
+    // With the usual few hundred uF on the supply, it takes a good few of these to go from the
+    // low level to where the board browns out.
+    static const unsigned long _checkInterval = 10 /*ms*/;
+    static const unsigned int _hysteresis = 200 /*mV*/;
+
+#ifdef __AVR_ATmega328P__
+    // The supply as the reference and the 1.1V bandgap as the input.
+    static const uint8_t _bandgapMux = _BV(REFS0) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1);
+#endif
+
+    const unsigned int _lowMillivolts;
+    const unsigned int _bandgapMillivolts;
+    unsigned int _millivolts;
+    bool _low;
+    unsigned long _lowCount;
+
+    ArduinoHandler _handlerLow;
+
+    bool _simulated;
+    unsigned int _simulatedMillivolts;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Thermostat.h"
+#include "RelayControl.h"
+#include "HeatDisplay.h"
+
+// Writes how hard each zone's heater has been working (and how well its sensor is reading) to
+// the serial port every so often, as a line of JSON per zone, so it can be collected and
+// compared across a number of thermostats.  After the zones comes a line for the display bus.
+class Telemetry
+{
+  public:
+
+    Telemetry(Print & out, Thermostat * thermostats, RelayControl * relays, uint8_t zoneCount, HeatDisplay * display)
+      : _out(out)
+      , _thermostats(thermostats)
+      , _relays(relays)
+      , _zoneCount(zoneCount)
+      , _display(display)
+    {
+    }
+
+    void Report(unsigned long & delay)
+    {
+      for ( uint8_t zone = 0; zone < _zoneCount; ++zone )
+      {
+        Thermostat & thermostat = _thermostats[zone];
+        RelayControl & relay = _relays[zone];
+        _out.print(F("{\"zone\":"));
+        _out.print(zone);
+        _out.print(F(",\"on\":"));
+        _out.print(relay.IsOn() ? F("true") : F("false"));
+        _out.print(F(",\"on_s\":"));
+        _out.print(relay.GetOnSeconds());
+        _out.print(F(",\"switches\":"));
+        _out.print(relay.GetSwitches());
+        _out.print(F(",\"today_min\":"));
+        _out.print(relay.GetOnMinutesToday());
+        _out.print(F(",\"yesterday_min\":"));
+        _out.print(relay.GetOnMinutesYesterday());
+        _out.print(F(",\"duty_pct\":"));
+        _out.print(relay.GetDutyToday());
+        _out.print(F(",\"reads\":"));
+        _out.print(thermostat.GetReads());
+        _out.print(F(",\"timeouts\":"));
+        _out.print(thermostat.GetTimeouts());
+        _out.print(F(",\"checksums\":"));
+        _out.print(thermostat.GetChecksums());
+        _out.print(F(",\"fail_run\":"));
+        _out.print(thermostat.GetConsecutiveFailures());
+        _out.print(F(",\"max_fail_run\":"));
+        _out.print(thermostat.GetMaxConsecutiveFailures());
+        _out.print(F(",\"fail_safe\":"));
+        _out.print(thermostat.IsFailSafe() ? F("true") : F("false"));
+        _out.println('}');
+      }
+      DisplaySegments & segments = _display->GetSegments();
+      _out.print(F("{\"display_frames\":"));
+      _out.print(segments.GetFramesSent());
+      _out.print(F(",\"display_bytes\":"));
+      _out.print(segments.GetBytesSent());
+      _out.print(F(",\"display_us\":"));
+      _out.print(segments.GetTransmitMicros());
+      _out.println('}');
+      delay = _reportInterval;
+    }
+
+  private:
+
+    static const unsigned long _reportInterval = 5 /*minutes*/ * 60UL * 1000;
+
+    Print & _out;
+    Thermostat * _thermostats;
+    RelayControl * _relays;
+    const uint8_t _zoneCount;
+    HeatDisplay * _display;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+// Common interface for the temperature sensors a Thermostat can use.  Reading a sensor is split
+// into two phases so sensors with a long conversion time never block the loop.  The thermostat
+// starts a conversion, then keeps polling for the result at whatever interval the sensor asks for.
+class TempSensor
+{
+  public:
+
+    virtual ~TempSensor()
+    {
+    }
+
+    // Kick off a new conversion and return how long (ms) to wait before polling for the result.
+    virtual unsigned long StartConversion() = 0;
+
+    // Returns true once the conversion is finished with the temp (or an error code) in tempCelsius.
+    // Otherwise returns false and sets delay to how long (ms) to wait before polling again.
+    virtual bool PollResult(int & tempCelsius, unsigned long & delay) = 0;
+
+    // The shortest time (ms) the sensor allows from the end of one read to the start of the next.
+    virtual unsigned long GetMinInterval()
+    {
+      return 0;
+    }
+
+  public:
+
+    // These match the error codes of the DHT11 library so anything at or above ERROR_TIMEOUT is an error.
+    static const int ERROR_TIMEOUT = 253;
+    static const int ERROR_CHECKSUM = 254;
+};
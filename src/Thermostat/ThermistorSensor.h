@@ -0,0 +1,77 @@
+#pragma once
+
+#include "TempSensor.h"
+
+// An NTC thermistor to ground with a series resistor to VCC, read on an analog pin.  The ADC is
+// oversampled to smooth out the noise, but only a few samples are taken per poll so the loop
+// is never held up for more than a fraction of a ms.
+class ThermistorSensor : public TempSensor
+{
+  public:
+
+    ThermistorSensor(int pinSensor,
+                     float seriesResistor = 10000.0,
+                     float nominalResistance = 10000.0,
+                     float beta = 3950.0)
+      : _pin(pinSensor)
+      , _seriesResistor(seriesResistor)
+      , _nominalResistance(nominalResistance)
+      , _beta(beta)
+      , _sampleSum(0)
+      , _sampleCount(0)
+    {
+    }
+
+    virtual unsigned long StartConversion()
+    {
+      _sampleSum = 0;
+      _sampleCount = 0;
+      return 0;
+    }
+
+    virtual bool PollResult(int & tempCelsius, unsigned long & delay)
+    {
+      for ( uint8_t i = 0; ( i < _samplesPerPoll ) && ( _sampleCount < _samples ); ++i, ++_sampleCount )
+      {
+        _sampleSum += analogRead(_pin);
+      }
+
+      if ( _sampleCount < _samples )
+      {
+        delay = _sampleInterval;
+        return false;
+      }
+
+      // A reading pegged at either end means the thermistor is open or shorted.
+      float adc = (float)_sampleSum / _samples;
+      if ( ( adc < 1.0 ) || ( adc > _adcMax - 1.0 ) )
+      {
+        tempCelsius = ERROR_TIMEOUT;
+        return true;
+      }
+
+      // Beta equation: 1/T = 1/T0 + ln(R/R0)/B (in kelvin).
+      float resistance = _seriesResistor * adc / (_adcMax - adc);
+      float kelvin = 1.0 / ( 1.0 / _nominalKelvin + log(resistance / _nominalResistance) / _beta );
+      tempCelsius = (int)(kelvin - _zeroCelsiusKelvin + 0.5);
+      return true;
+    }
+
+  private:
+
+    static const uint8_t _samples = 64;
+    static const uint8_t _samplesPerPoll = 4;
+    static const unsigned long _sampleInterval = 1 /*ms*/;
+
+    static constexpr float _adcMax = 1023.0;
+    static constexpr float _zeroCelsiusKelvin = 273.15;
+    static constexpr float _nominalKelvin = _zeroCelsiusKelvin + 25.0;
+
+    const int _pin;
+    const float _seriesResistor;
+    const float _nominalResistance;
+    const float _beta;
+
+    unsigned long _sampleSum;
+    uint8_t _sampleCount;
+};
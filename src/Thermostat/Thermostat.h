@@ -1,18 +1,48 @@
 #pragma once
 
-#include <DHT11.h>  // https://github.com/dhrubasaha08/DHT11
+#include "TempSensor.h"
 #include "PersistedData.h"
-#include "ArduinoHandler.h"
+#include "EventBus.h"
+#include "Clock.h"
 
 class Thermostat
 {
   public:
 
-    Thermostat(int pinSensor, PersistedData * storage)
-      : _dht11(pinSensor)
+    // Temp, relay and config changes are all published on the bus for anyone that is interested.
+    Thermostat(TempSensor * sensor, PersistedData * storage, EventBus * bus, uint8_t zone = 0)
+      : _sensor(sensor)
       , _storage(storage)
+      , _bus(bus)
+      , _zone(zone)
       , _currentTempCelsius(ERROR_INIT)
-      , _triggerTempFahrenheit(storage->get_ThermostatTemp())
+      , _triggerTempFahrenheit(storage->get_ThermostatTemp(zone))
+      , _setbackFahrenheit(0)
+      , _converting(false)
+      , _relayOn(false)
+      , _relayKnown(false)
+      , _model(storage->get_HeatModel(zone))
+      , _switchTime(0)
+      , _extremeTemp(ERROR_INIT)
+      , _extremeTime(0)
+      , _extremeEnd(0)
+      , _failSafeTimeout(_defaultFailSafeTimeout)
+      , _failSafeRelayOn(false)
+      , _failSafe(false)
+      , _lastGoodRead(Clock::Now())
+      , _reads(0)
+      , _timeouts(0)
+      , _checksums(0)
+      , _consecutiveFailures(0)
+      , _maxConsecutiveFailures(0)
+      , _pollMin(_defaultPollMin)
+      , _pollMax(_defaultPollMax)
+      , _filteredTemp(0)
+      , _slope(0)
+      , _lastFilteredTime(0)
+      , _filterStarted(false)
+      , _slotOffset(0)
+      , _slotPeriod(0)
     {
     }
 
@@ -20,37 +50,135 @@ class Thermostat
     {
     }
 
-    template <typename T>
-    void RegisterTempHandler(T* obj, void (T::*method)(int))
+    void RefreshTemp(unsigned long & delay)
     {
-      _handlerDisplay.Register(obj, method);
+      // Reading the temp is done in two phases so that we don't block the loop while
+      // the sensor is converting.  First we start it and come back when it should be ready.
+      if ( !_converting )
+      {
+        _converting = true;
+        delay = _sensor->StartConversion();
+        if ( delay > 0 )
+        {
+          return;
+        }
+      }
 
-      // Just for completeness, we should try to notify the display the current temp
-      // right when they register so they don't have to wait for the temp to change.
-      // In practice, this won't do much since we register right away before we've got
-      // a temp.  I don't want to actually read the temp here since that would happen
-      // twice on startup, first now and then again the first time the worker calls us.
-      if ( !IsErr(_currentTempCelsius) )
+      // Then we poll till it is done, which may take more than one try.
+      int tempCelsius;
+      if ( !_sensor->PollResult(tempCelsius, /*byref*/ delay) )
       {
-        _handlerDisplay.Invoke(_currentTempCelsius);
+        return;
       }
+
+      _converting = false;
+      ++_reads;
+      _bus->Publish(EventReading, _zone, tempCelsius);
+      if ( IsErr(tempCelsius) )
+      {
+        delay = AlignToSlot(ReadFailed(tempCelsius));
+        return;
+      }
+
+      _consecutiveFailures = 0;
+      _lastGoodRead = Clock::Now();
+      if ( _failSafe )
+      {
+        // The relay was forced, so it needs to be told what it should really be even if the
+        // temp is the same as the last good one.
+        _failSafe = false;
+        _bus->Publish(EventFault, _zone, false);
+        UpdateTemp(tempCelsius);
+        RefreshRelay(false);
+      }
+      else
+      {
+        UpdateTemp(tempCelsius);
+      }
+      Filter(tempCelsius);
+      delay = AlignToSlot(NextPollDelay());
     }
 
-    template <typename T>
-    void RegisterRelayHandler(T* obj, void (T::*method)(bool))
+    // How often the sensor is read depends on how soon the temp could reach the switch point,
+    // but is always kept within these (and never faster than the sensor allows).
+    void SetPollBounds(unsigned long pollMin, unsigned long pollMax)
     {
-      _handlerRelay.Register(obj, method);
+      _pollMin = pollMin;
+      _pollMax = pollMax;
+    }
 
-      // We want to refresh the relay right away when it first registers.
-      // If we don't have our temp yet, this won't do anything but then we'll
-      // get it the first time we do setup the temp, so no big deal.
-      RefreshRelay();
+    // With more than one zone, each zone's reads are kept to its own slot (offset) in every
+    // period, so however their polls vary no two zones are ever due in the same pass.
+    void SetReadSlot(unsigned long offset, unsigned long period)
+    {
+      _slotOffset = offset;
+      _slotPeriod = period;
     }
 
-    void RefreshTemp(unsigned long & delay)
+    // The schedule moves the trigger temp up or down by this much (in fahrenheit) from the one
+    // the user set, for as long as it says.
+    void SetSetback(int fahrenheit)
+    {
+      if ( _setbackFahrenheit != fahrenheit )
+      {
+        _setbackFahrenheit = fahrenheit;
+        RefreshRelay(false);
+      }
+    }
+
+    int GetSetback()
+    {
+      return _setbackFahrenheit;
+    }
+
+    // Picks up from the temp saved before a reset, so the display (and the fail safe timing)
+    // have something to go on till the first read.  The relay is restored separately.
+    void Restore(int tempCelsius)
+    {
+      _currentTempCelsius = tempCelsius;
+    }
+
+    // If the sensor hasn't given a good reading for this long, the relay is forced to the given
+    // state until it does.
+    void SetFailSafe(unsigned long timeout, bool relayOn)
+    {
+      _failSafeTimeout = timeout;
+      _failSafeRelayOn = relayOn;
+    }
+
+    bool IsFailSafe()
+    {
+      return _failSafe;
+    }
+
+    unsigned long GetReads()
+    {
+      return _reads;
+    }
+
+    unsigned long GetTimeouts()
     {
-      RefreshTemp();
-      delay = _refreshInterval;
+      return _timeouts;
+    }
+
+    unsigned long GetChecksums()
+    {
+      return _checksums;
+    }
+
+    uint8_t GetConsecutiveFailures()
+    {
+      return _consecutiveFailures;
+    }
+
+    uint8_t GetMaxConsecutiveFailures()
+    {
+      return _maxConsecutiveFailures;
+    }
+
+    uint8_t GetZone()
+    {
+      return _zone;
     }
 
     int GetCurrentTemp(bool celsius)
@@ -63,42 +191,222 @@ class Thermostat
       return celsius ? ConvertFtoC(_triggerTempFahrenheit) : _triggerTempFahrenheit;
     }
 
-    int IncTriggerTemp(bool celsius)
+    int IncTriggerTemp(bool celsius, int steps = 1)
     {
-      return ChangeTriggerTemp(celsius, 1);
+      return ChangeTriggerTemp(celsius, steps);
     }
 
-    int DecTriggerTemp(bool celsius)
+    int DecTriggerTemp(bool celsius, int steps = 1)
     {
-      return ChangeTriggerTemp(celsius, -1);
+      return ChangeTriggerTemp(celsius, -steps);
     }
 
     static bool IsErr(int temp)
     {
-      return (temp >= DHT11::ERROR_TIMEOUT);
+      return (temp >= TempSensor::ERROR_TIMEOUT);
+    }
+
+    // How far ahead (in hundredths of a degree celsius) the relay is switched on (or off), to
+    // make up for the temp carrying on after it does.  After it comes on the temp keeps rising
+    // at the off rate for the lag, and after it goes off it keeps falling at the on rate.
+    int GetAnticipation(bool relayOn)
+    {
+      // Only once we've seen the relay actually turn the temp around both ways.
+      if ( ( _model.rateOff <= 0 ) || ( _model.rateOn >= 0 ) )
+      {
+        return 0;
+      }
+      long rate = relayOn ? _model.rateOff : -(long)_model.rateOn;
+      long anticipation = rate * _model.lagSeconds / 60;
+      return anticipation < _maxAnticipation ? anticipation : _maxAnticipation;
     }
 
   private:
 
-    void RefreshTemp()
+    // Returns how long to wait before trying again.
+    unsigned long ReadFailed(int error)
+    {
+      if ( TempSensor::ERROR_CHECKSUM == error )
+      {
+        ++_checksums;
+      }
+      else
+      {
+        ++_timeouts;
+      }
+      if ( _consecutiveFailures < 0xFF )
+      {
+        ++_consecutiveFailures;
+      }
+      if ( _consecutiveFailures > _maxConsecutiveFailures )
+      {
+        _maxConsecutiveFailures = _consecutiveFailures;
+      }
+
+      // A single bad read is common, so we hang on to the last good temp for a while and only
+      // show the error once it is too old to trust (two of the longest polls).
+      unsigned long sinceGood = Clock::Now() - _lastGoodRead;
+      if ( ( sinceGood >= 2 * _pollMax ) && !IsErr(_currentTempCelsius) )
+      {
+        UpdateTemp(error);
+      }
+
+      // Without a temp we can't tell what the relay should be, so after long enough it goes to
+      // the safe state rather than being left however it was.  It is told again on every
+      // failed read after that, so the relay ends up there even if something else (a warm
+      // start, or an event that didn't get through) left it otherwise.  Once it is there, the
+      // relay just writes its pin the same again.
+      if ( sinceGood >= _failSafeTimeout )
+      {
+        if ( !_failSafe )
+        {
+          _failSafe = true;
+          _relayKnown = false;
+          _bus->Publish(EventFault, _zone, true);
+        }
+        _bus->Publish(EventRelay, _zone, _failSafeRelayOn);
+      }
+
+      // Retry quickly at first in case it was a glitch, then back off to the normal interval.
+      uint8_t shift = _consecutiveFailures - 1;
+      unsigned long retry = shift < _maxRetryShift ? _retryInterval << shift : _pollMax;
+      return retry > _sensor->GetMinInterval() ? retry : _sensor->GetMinInterval();
+    }
+
+    // The filtered temp and its slope are kept in hundredths of a degree (per minute for the
+    // slope) so the whole degree steps of the sensor smooth out into something we can use.
+    void Filter(int tempCelsius)
+    {
+      unsigned long now = Clock::Now();
+      long temp = (long)tempCelsius * 100;
+      if ( !_filterStarted )
+      {
+        _filteredTemp = temp;
+        _slope = 0;
+        _filterStarted = true;
+      }
+      else
+      {
+        long lastFiltered = _filteredTemp;
+        _filteredTemp += (temp - _filteredTemp) / 2;
+        unsigned long elapsed = now - _lastFilteredTime;
+        if ( elapsed > 0 )
+        {
+          long slope = (_filteredTemp - lastFiltered) * 60000 / (long)elapsed;
+          _slope += (slope - _slope) / 4;
+        }
+      }
+      _lastFilteredTime = now;
+    }
+
+    unsigned long NextPollDelay()
+    {
+      // The sensor only reads whole degrees, so the relay actually switches when the real temp
+      // gets half way to the first whole degree at or past the switch point (above it to turn
+      // on, below it to turn off).
+      long target;
+      if ( _relayKnown && _relayOn )
+      {
+        long offPoint = GetOffPoint();
+        target = ( offPoint - ( offPoint < 0 ? 99 : 0 ) ) / 100 * 100 + 50;
+      }
+      else
+      {
+        long onPoint = GetOnPoint();
+        target = ( onPoint + 99 - ( onPoint < 0 ? 99 : 0 ) ) / 100 * 100 - 50;
+      }
+      // The filtered temp says where the real temp is between the whole degree readings.
+      long distance = target - _filteredTemp;
+
+      // If the temp is heading that way, read again about half way to when it should get there
+      // (and as often as we can once the next degree would switch the relay).
+      if ( ( _slope != 0 ) && ( ( distance > 0 ) == ( _slope > 0 ) ) )
+      {
+        if ( abs(distance) < _nearDistance )
+        {
+          return ClampPoll(_pollMin);
+        }
+        unsigned long eta = abs(distance) * 60000 / abs(_slope);
+        return ClampPoll(eta / 2);
+      }
+
+      // Otherwise nothing is going to change till it turns around, which could be soon if it
+      // is still close.
+      return ClampPoll(abs(distance) < _nearDistance ? _pollMax / 4 : _pollMax);
+    }
+
+    // Pushes the next read back to the start of our slot, if we have one.
+    unsigned long AlignToSlot(unsigned long delay)
+    {
+      if ( !_slotPeriod )
+      {
+        return delay;
+      }
+      unsigned long due = (Clock::Now64() + delay) % _slotPeriod;
+      return delay + ( _slotOffset + _slotPeriod - due ) % _slotPeriod;
+    }
+
+    unsigned long ClampPoll(unsigned long delay)
+    {
+      unsigned long pollMin = _pollMin > _sensor->GetMinInterval() ? _pollMin : _sensor->GetMinInterval();
+      return delay < pollMin ? pollMin : ( delay > _pollMax ? _pollMax : delay );
+    }
+
+    // The temps (in hundredths of a degree celsius) at or above which the relay turns on, and
+    // at or below which it turns back off.  Without any anticipation that is the trigger and a
+    // degree under it, which for whole degree readings is the same as on at the trigger and off
+    // under it.  Each is moved by its own anticipation, but the off point is always kept under
+    // the on point so a reading can't be both.
+    long GetOnPoint()
+    {
+      return GetTriggerPoint() - GetAnticipation(true);
+    }
+
+    long GetOffPoint()
+    {
+      long offPoint = GetTriggerPoint() - 100 + GetAnticipation(false);
+      long limit = GetOnPoint() - 1;
+      return offPoint < limit ? offPoint : limit;
+    }
+
+    long GetTriggerPoint()
+    {
+      int triggerFahrenheit = constrain(_triggerTempFahrenheit + _setbackFahrenheit, _minTriggerTempFahrenheit, _maxTriggerTempFahrenheit);
+      return (long)ConvertFtoC(triggerFahrenheit) * 100;
+    }
+
+    void UpdateTemp(int tempCelsius)
     {
       const int lastTemp = _currentTempCelsius;
-      _currentTempCelsius = _dht11.readTemperature();
+      _currentTempCelsius = tempCelsius;
+      if ( !IsErr(_currentTempCelsius) )
+      {
+        TrackExtreme();
+      }
       if ( lastTemp != _currentTempCelsius )
       {
-        _handlerDisplay.Invoke(_currentTempCelsius);
+        _bus->Publish(EventTemp, _zone, _currentTempCelsius);
         RefreshRelay();
       }
     }
 
-    void RefreshRelay()
+    // Only a switch the temp brought about says anything about how the temp responds, so
+    // one from the user or the schedule moving the trigger isn't learned from.
+    void RefreshRelay(bool learn = true)
     {
-      if ( !IsErr(_currentTempCelsius) )
+      if ( !IsErr(_currentTempCelsius) && !_failSafe )
       {
         // We always tell the relay what its state should be when the temp
-        // changes and let it decide if it needs to do anything.
-        bool relayOn = _currentTempCelsius >= ConvertFtoC(_triggerTempFahrenheit);
-        _handlerRelay.Invoke(relayOn);
+        // changes and let it decide if it needs to do anything.  It goes on early by how far
+        // the temp is expected to keep rising, and off early by how far it is expected to keep
+        // falling, so it turns around at the trigger rather than past it.
+        long temp = (long)_currentTempCelsius * 100;
+        bool relayOn = ( _relayKnown && _relayOn ) ? ( temp > GetOffPoint() ) : ( temp >= GetOnPoint() );
+        if ( !_relayKnown || ( relayOn != _relayOn ) )
+        {
+          LearnSwitch(relayOn, learn);
+        }
+        _bus->Publish(EventRelay, _zone, relayOn);
       }
     }
 
@@ -109,12 +417,70 @@ class Thermostat
       _triggerTempFahrenheit = constrain(newTempF, _minTriggerTempFahrenheit, _maxTriggerTempFahrenheit);
       if ( oldTempF != newTempF )
       {
-        _storage->set_ThermostatTemp(_triggerTempFahrenheit);
-        RefreshRelay();
+        _storage->set_ThermostatTemp(_triggerTempFahrenheit, _zone);
+        _bus->Publish(EventConfig, _zone, _triggerTempFahrenheit);
+        RefreshRelay(false);
       }
       return celsius ? ConvertFtoC(_triggerTempFahrenheit) : _triggerTempFahrenheit;
     }
 
+    // After the relay switches, the temp keeps going the way it was for a while (the lag) and
+    // only then turns around.  So we track how far it goes and when it turns, and at the next
+    // switch we know the lag and the rate it changed at (from the turn to the switch).  The
+    // sensor only reads whole degrees, so the temp sits at the extreme for a while and the turn
+    // is taken to be half way through that.
+    void TrackExtreme()
+    {
+      if ( !_relayKnown )
+      {
+        return;
+      }
+      // The relay comes on when it is hot, so while on the temp should peak and then fall and
+      // while off it should bottom out and then rise.
+      if ( IsErr(_extremeTemp) ||
+           ( _relayOn && ( _currentTempCelsius > _extremeTemp ) ) ||
+           ( !_relayOn && ( _currentTempCelsius < _extremeTemp ) ) )
+      {
+        _extremeTemp = _currentTempCelsius;
+        _extremeTime = Clock::Now();
+        _extremeEnd = _extremeTime;
+      }
+      else if ( _currentTempCelsius == _extremeTemp )
+      {
+        _extremeEnd = Clock::Now();
+      }
+    }
+
+    void LearnSwitch(bool relayOn, bool learn)
+    {
+      unsigned long now = Clock::Now();
+      unsigned long turn = _extremeTime + (_extremeEnd - _extremeTime) / 2;
+      unsigned long settled = now - turn;
+      if ( learn && _relayKnown && !IsErr(_extremeTemp) && ( settled >= _minLearnTime ) )
+      {
+        // All fixed point, the rate is in hundredths of a degree per minute.
+        long rate = (long)(_currentTempCelsius - _extremeTemp) * 100 * 60000 / (long)settled;
+        long lag = (turn - _switchTime) / 1000;
+        int16_t & modelRate = _relayOn ? _model.rateOn : _model.rateOff;
+        modelRate = Smooth(modelRate, rate);
+        _model.lagSeconds = Smooth(_model.lagSeconds, lag);
+        _storage->set_HeatModel(_model, _zone);
+      }
+
+      _relayOn = relayOn;
+      _relayKnown = true;
+      _switchTime = now;
+      _extremeTemp = _currentTempCelsius;
+      _extremeTime = now;
+      _extremeEnd = now;
+    }
+
+    // A moving average that weights the newest sample a quarter, and takes the first as is.
+    static long Smooth(long average, long sample)
+    {
+      return average ? average + (sample - average) / 4 : sample;
+    }
+
     static int ConvertCtoF(int celsius)
     {
       return (celsius * 9 + 160) / 5;
@@ -128,6 +494,11 @@ class Thermostat
   public:
 
     static const int ERROR_INIT = 255;
+
+    // Reading the sensor bit-bangs the bus and blocks the loop while it does.  When there are
+    // multiple zones, each one should start this much later than the previous so only one
+    // sensor is ever read in a single worker pass.
+    static const unsigned long SENSOR_STAGGER = 500 /*ms*/;
  
   private:
 
@@ -135,14 +506,27 @@ class Thermostat
     static const int _maxTriggerTempFahrenheit = 122;
     static const int _minTriggerTempFahrenheit = 32;
     
-    static const unsigned long _refreshInterval = 30 /*second*/ * 1000;
+    // The temp needs to have been moving for a few readings after it turns before the rate
+    // means much, and we never switch more than a few degrees early however wrong the model is.
+    static const unsigned long _minLearnTime = 2 /*minutes*/ * 60UL * 1000;
+    static const int _maxAnticipation = 300;
 
-    DHT11 _dht11;
+    // Failed reads are retried after 1s, 2s, 4s and so on, then at the longest poll.
+    static const unsigned long _retryInterval = 1 /*second*/ * 1000;
+    static const uint8_t _maxRetryShift = 5;
+    static const unsigned long _defaultFailSafeTimeout = 5 /*minutes*/ * 60UL * 1000;
 
-    PersistedData * _storage;
+    // Within this distance (hundredths of a degree) of the switch point the temp could turn and
+    // head for it at any time.
+    static const long _nearDistance = 100;
+    static const unsigned long _defaultPollMin = 5 /*seconds*/ * 1000;
+    static const unsigned long _defaultPollMax = 2 /*minutes*/ * 60UL * 1000;
 
-    ArduinoHandlerParam<int> _handlerDisplay;
-    ArduinoHandlerParam<bool> _handlerRelay;
+    TempSensor * _sensor;
+
+    PersistedData * _storage;
+    EventBus * _bus;
+    const uint8_t _zone;
 
     // The sensor uses celsius, so we store it that way.
     int _currentTempCelsius;
@@ -150,5 +534,39 @@ class Thermostat
     // But the user might want to see it as fahrenheit which is more granular,
     // so we store the trigger as fahrenheit so the user doesn't see weird jumps.
     int _triggerTempFahrenheit;
+    int _setbackFahrenheit;
+
+    // Whether we've started a conversion and are waiting on the result.
+    bool _converting;
+
+    // The learned model and what we need to keep learning it.
+    bool _relayOn;
+    bool _relayKnown;
+    PersistedData::HeatModel _model;
+    unsigned long _switchTime;
+    int _extremeTemp;
+    unsigned long _extremeTime;
+    unsigned long _extremeEnd;
+
+    // Sensor fault handling and the error stats.
+    unsigned long _failSafeTimeout;
+    bool _failSafeRelayOn;
+    bool _failSafe;
+    unsigned long _lastGoodRead;
+    unsigned long _reads;
+    unsigned long _timeouts;
+    unsigned long _checksums;
+    uint8_t _consecutiveFailures;
+    uint8_t _maxConsecutiveFailures;
+
+    // The adaptive polling.
+    unsigned long _pollMin;
+    unsigned long _pollMax;
+    long _filteredTemp;
+    long _slope;
+    unsigned long _lastFilteredTime;
+    bool _filterStarted;
+    unsigned long _slotOffset;
+    unsigned long _slotPeriod;
 };
 
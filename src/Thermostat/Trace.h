@@ -0,0 +1,371 @@
+#pragma once
+
+#include "ArduinoWorker.h"
+#include "ButtonPress.h"
+#include "EventBus.h"
+#include "SimulatedSensor.h"
+#include "SupplyMonitor.h"
+#include "Clock.h"
+
+// A trace is a short header followed by a stream of records.  Each record starts with a byte
+// holding the type (top 3 bits) and the button pin or zone (bottom 5 bits), then the ms since the
+// previous record as a varint.  Temp records add the temp as a zigzag varint, supply records add
+// the millivolts as a varint and read cost records add how long (in us) each read of the zone's
+// sensor blocks for as a varint.  Most records are only 2 or 3 bytes, so even days of input make
+// for a small trace.  The supply and read cost are only ever scripted, they aren't recorded.
+enum TraceRecordType : uint8_t
+{
+  TraceButtonUp,
+  TraceButtonDown,
+  TraceTemp,
+  TraceRelayOff,
+  TraceRelayOn,
+  TraceSupply,
+  TraceReadCost,
+  TraceEnd
+};
+
+static const uint8_t TraceMagic[] PROGMEM = { 'T', 'R', 1 /*version*/ };
+
+// Streams the button edges and sensor readings (the inputs) plus the relay changes (the output)
+// as they happen.  Everything is stamped with the time the worker pass started, since that is
+// the time the components themselves saw.
+class TraceRecorder
+{
+  public:
+
+    TraceRecorder(Print & out, ArdunioWorker * worker)
+      : _out(out)
+      , _worker(worker)
+      , _lastTime(0)
+      , _started(false)
+    {
+    }
+
+    void Watch(ButtonPress * button)
+    {
+      button->RegisterEdgeHandler(this, &TraceRecorder::OnButtonEdge);
+    }
+
+    void Watch(EventBus * bus)
+    {
+      bus->Subscribe(EventReading | EventRelay, this, &TraceRecorder::OnEvent);
+    }
+
+    void OnButtonEdge(const ButtonPress & button)
+    {
+      WriteRecord(button.IsPressed() ? TraceButtonDown : TraceButtonUp, button.GetPin());
+    }
+
+    void OnEvent(const Event & event)
+    {
+      if ( EventReading == event.type )
+      {
+        // Zigzag encoding keeps small negative temps small too.
+        WriteRecord(TraceTemp, event.zone);
+        WriteVarint(event.value < 0 ? ((unsigned long)-event.value << 1) - 1 : (unsigned long)event.value << 1);
+      }
+      else
+      {
+        WriteRecord(event.value ? TraceRelayOn : TraceRelayOff, event.zone);
+      }
+    }
+
+    void End()
+    {
+      WriteRecord(TraceEnd, 0);
+    }
+
+  private:
+
+    void WriteRecord(TraceRecordType type, uint8_t id)
+    {
+      unsigned long now = _worker->GetPassTime();
+      if ( !_started )
+      {
+        for ( uint8_t i = 0; i < sizeof(TraceMagic); ++i )
+        {
+          _out.write(pgm_read_byte(&TraceMagic[i]));
+        }
+        _lastTime = now;
+        _started = true;
+      }
+      _out.write((uint8_t)((type << 5) | (id & 0x1F)));
+      WriteVarint(now - _lastTime);
+      _lastTime = now;
+    }
+
+    void WriteVarint(unsigned long value)
+    {
+      while ( value >= 0x80 )
+      {
+        _out.write((uint8_t)(value | 0x80));
+        value >>= 7;
+      }
+      _out.write((uint8_t)value);
+    }
+
+  private:
+
+    Print & _out;
+    ArdunioWorker * _worker;
+    unsigned long _lastTime;
+    bool _started;
+};
+
+// Feeds a recorded trace back through the buttons and sensors on a virtual clock.  Rather than
+// waiting, the clock jumps straight to each worker deadline, so replay runs as fast as the
+// workers themselves can.  A pass that runs past the next deadline (like one held up by a slow
+// read) holds up the next pass till it is done, the same as on the board.  The outputs (like the relay) can be recorded again with a second
+// TraceRecorder and compared with the original, or with a replay on another firmware build.
+class TraceReplay
+{
+  public:
+
+    TraceReplay(ArdunioWorker * worker)
+      : _worker(worker)
+      , _buttonCount(0)
+      , _sensorCount(0)
+      , _sensorTemps(0)
+      , _supply(nullptr)
+      , _time(0)
+      , _nextPass(0)
+    {
+    }
+
+    // Buttons are matched to the trace by their pin.
+    bool AddButton(ButtonPress * button)
+    {
+      if ( _buttonCount >= _maxButtons )
+      {
+        return false;
+      }
+      _buttons[_buttonCount++] = button;
+      return true;
+    }
+
+    // Sensors are matched to the trace by their zone, which is the order they are added in.  One
+    // whose temps come from somewhere else (like a simulated plant) only takes its read cost from
+    // the trace.
+    bool AddSensor(SimulatedSensor * sensor, bool temps = true)
+    {
+      if ( _sensorCount >= _maxSensors )
+      {
+        return false;
+      }
+      if ( temps )
+      {
+        _sensorTemps |= 1 << _sensorCount;
+      }
+      _sensors[_sensorCount++] = sensor;
+      return true;
+    }
+
+    void AddSupply(SupplyMonitor * supply)
+    {
+      _supply = supply;
+    }
+
+    // Returns false if the trace is not valid.  Otherwise it returns once the end of it is reached.
+    bool Run(Stream & in)
+    {
+      uint8_t magic[sizeof(TraceMagic)];
+      if ( ( in.readBytes(magic, sizeof(magic)) != sizeof(magic) ) || memcmp_P(magic, TraceMagic, sizeof(magic)) )
+      {
+        return false;
+      }
+
+      // Nothing has been read until the trace says so.  Having the sensors wait for each reading
+      // keeps the reads in step with the original ones, however far our passes drift from theirs.
+      for ( uint8_t i = 0; i < _sensorCount; ++i )
+      {
+        if ( HasTemps(i) )
+        {
+          _sensors[i]->Reset(TempSensor::ERROR_TIMEOUT);
+          _sensors[i]->SetWaitForTemp(true);
+        }
+      }
+      if ( _supply )
+      {
+        _supply->SetSimulatedMillivolts(SupplyMonitor::NOMINAL_MILLIVOLTS);
+      }
+
+      _nextPass = _time * 1000;
+      Clock::SetVirtualMicros(_nextPass);
+      while ( true )
+      {
+        uint8_t head;
+        unsigned long delta;
+        if ( !ReadByte(in, head) || !ReadVarint(in, delta) )
+        {
+          return false;
+        }
+        _time += delta;
+
+        uint8_t id = head & 0x1F;
+        switch ( head >> 5 )
+        {
+          case TraceButtonUp:
+          case TraceButtonDown:
+          {
+            // The edge has to be there before the pass at that time checks the button.
+            RunUntil(_time, false);
+            for ( uint8_t i = 0; i < _buttonCount; ++i )
+            {
+              if ( _buttons[i]->GetPin() == id )
+              {
+                _buttons[i]->SetSimulatedState(TraceButtonDown == (head >> 5));
+              }
+            }
+            break;
+          }
+
+          case TraceTemp:
+          {
+            unsigned long zigzag;
+            if ( !ReadVarint(in, zigzag) )
+            {
+              return false;
+            }
+            int temp = (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+            if ( HasTemps(id) )
+            {
+              // If the last reading still hasn't been used, let the workers catch up to it first.
+              while ( _sensors[id]->IsPending() && RunPass(_time) )
+              {
+              }
+              _sensors[id]->SetTemp(temp);
+            }
+            RunUntil(_time, true);
+            break;
+          }
+
+          case TraceSupply:
+          {
+            unsigned long millivolts;
+            if ( !ReadVarint(in, millivolts) )
+            {
+              return false;
+            }
+            RunUntil(_time, false);
+            if ( _supply )
+            {
+              _supply->SetSimulatedMillivolts(millivolts);
+            }
+            break;
+          }
+
+          case TraceReadCost:
+          {
+            unsigned long cost;
+            if ( !ReadVarint(in, cost) )
+            {
+              return false;
+            }
+            RunUntil(_time, false);
+            if ( id < _sensorCount )
+            {
+              _sensors[id]->SetReadCost(cost);
+            }
+            break;
+          }
+
+          case TraceEnd:
+            RunUntil(_time, true);
+            return true;
+
+          default:
+            // The outputs that were recorded are only there to compare against.
+            break;
+        }
+      }
+    }
+
+  private:
+
+    bool HasTemps(uint8_t zone)
+    {
+      return ( zone < _sensorCount ) && ( _sensorTemps & (1 << zone) );
+    }
+
+    // Runs the pass that is due next as long as it is before (or at) the given time (in ms).
+    bool RunPass(uint64_t until, bool inclusive = true)
+    {
+      uint64_t untilMicros = until * 1000;
+      if ( ( _nextPass > untilMicros ) || ( !inclusive && ( _nextPass == untilMicros ) ) )
+      {
+        return false;
+      }
+      Clock::SetVirtualMicros(_nextPass);
+      unsigned long next = _worker->RunWorkers();
+
+      // The next pass is due when the workers asked for, but never before this one has finished.
+      // A worker that wants to run again right away gets the next pass as soon as this one is
+      // done, like the loop() on the board.  Don't jump past the point where nothing is scheduled.
+      uint64_t start = _nextPass;
+      uint64_t done = Clock::VirtualMicros();
+      _nextPass = start + (uint64_t)(next < _maxStep ? next : _maxStep) * 1000;
+      if ( _nextPass < done )
+      {
+        _nextPass = done;
+      }
+
+      // Always move forward so nothing can keep us at the same time forever.
+      if ( _nextPass <= start )
+      {
+        _nextPass = start + 1;
+      }
+      return true;
+    }
+
+    void RunUntil(uint64_t until, bool inclusive)
+    {
+      while ( RunPass(until, inclusive) )
+      {
+      }
+      Clock::SetVirtualMicros(until * 1000);
+    }
+
+    bool ReadByte(Stream & in, uint8_t & value)
+    {
+      return 1 == in.readBytes(&value, 1);
+    }
+
+    bool ReadVarint(Stream & in, unsigned long & value)
+    {
+      value = 0;
+      for ( uint8_t shift = 0; shift < 32; shift += 7 )
+      {
+        uint8_t next;
+        if ( !ReadByte(in, next) )
+        {
+          return false;
+        }
+        value |= (unsigned long)(next & 0x7F) << shift;
+        if ( !(next & 0x80) )
+        {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+
+    static const uint8_t _maxButtons = 4;
+    static const uint8_t _maxSensors = 4;
+    static const unsigned long _maxStep = 1 /*seconds*/ * 1000;
+
+    ArdunioWorker * _worker;
+    ButtonPress * _buttons[_maxButtons];
+    uint8_t _buttonCount;
+    SimulatedSensor * _sensors[_maxSensors];
+    uint8_t _sensorCount;
+    uint8_t _sensorTemps;
+    SupplyMonitor * _supply;
+
+    // The trace's time in ms, and when the next pass is due in us.  Both are 64 bits, so a trace
+    // can run for longer than the 32 bit clock goes before it wraps.
+    uint64_t _time;
+    uint64_t _nextPass;
+};
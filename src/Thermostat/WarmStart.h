@@ -0,0 +1,158 @@
+#pragma once
+
+#include "EventBus.h"
+#include "TempSensor.h"
+#include "PersistedData.h"
+#include "Clock.h"
+
+// Keeps the last temp and relay state of each zone in a bit of RAM that isn't cleared at boot,
+// so after a watchdog or brownout reset the relays can go straight back to what they were rather
+// than waiting on the first sensor reads.  Writing it is just a RAM write, so it can be kept
+// up to date with every change.  A power cycle loses it (which the checksum catches), and then
+// we just start cold like before.
+class WarmStart
+{
+  public:
+
+    WarmStart()
+    {
+    }
+
+    // The snapshot is only trusted if it is intact and the zone's temp wasn't too old when
+    // we reset.  Returns false if there is nothing to restore for the zone.
+    bool Restore(uint8_t zone, int & tempCelsius, bool & relayOn)
+    {
+      if ( !IsIntact() || !IsFresh(zone) )
+      {
+        return false;
+      }
+      ZoneSnapshot & snapshot = _snapshot.zones[zone];
+      tempCelsius = snapshot.tempCelsius;
+      relayOn = snapshot.relayOn;
+      return true;
+    }
+
+    // Starts a new snapshot, this needs to be called once everything has been restored.  The
+    // zones that could be restored carry on in it (just as old as they were), so if we reset
+    // again before their next read they can still be restored.
+    void Start()
+    {
+      bool intact = IsIntact();
+      unsigned long now = Clock::Now();
+      for ( uint8_t zone = 0; zone < PersistedData::MAX_ZONES; ++zone )
+      {
+        ZoneSnapshot & snapshot = _snapshot.zones[zone];
+        if ( intact && IsFresh(zone) )
+        {
+          // The time started again from zero at the reset.
+          snapshot.savedAt = now - ( _snapshot.aliveAt - snapshot.savedAt );
+        }
+        else
+        {
+          memset(&snapshot, 0, sizeof(snapshot));
+        }
+      }
+      _snapshot.magic = _magic;
+      _snapshot.aliveAt = now;
+      _snapshot.checksum = Checksum();
+    }
+
+    void OnEvent(const Event & event)
+    {
+      if ( event.zone >= PersistedData::MAX_ZONES )
+      {
+        return;
+      }
+      ZoneSnapshot & snapshot = _snapshot.zones[event.zone];
+      if ( EventTemp == event.type )
+      {
+        // An error isn't worth restoring, so just let the snapshot age out.
+        if ( event.value >= TempSensor::ERROR_TIMEOUT )
+        {
+          return;
+        }
+        snapshot.tempCelsius = event.value;
+        snapshot.savedAt = Clock::Now();
+        snapshot.valid = true;
+      }
+      else
+      {
+        snapshot.relayOn = event.value;
+      }
+      _snapshot.aliveAt = Clock::Now();
+      _snapshot.checksum = Checksum();
+    }
+
+    // Marks how recently we were still running, so after a reset we can tell how old the temps
+    // had got by then.
+    void Heartbeat(unsigned long & delay)
+    {
+      _snapshot.aliveAt = Clock::Now();
+      _snapshot.checksum = Checksum();
+      delay = _heartbeatInterval;
+    }
+
+  private:
+
+    bool IsIntact()
+    {
+      return ( _snapshot.magic == _magic ) && ( _snapshot.checksum == Checksum() );
+    }
+
+    bool IsFresh(uint8_t zone)
+    {
+      ZoneSnapshot & snapshot = _snapshot.zones[zone];
+      return snapshot.valid && ( _snapshot.aliveAt - snapshot.savedAt <= _maxAge );
+    }
+
+    uint16_t Checksum()
+    {
+      // A simple Fletcher sum is plenty to catch RAM that came up random at power on.
+      const uint8_t * data = (const uint8_t *)&_snapshot;
+      uint8_t sum1 = 0;
+      uint8_t sum2 = 0;
+      for ( uint8_t i = 0; i < offsetof(Snapshot, checksum); ++i )
+      {
+        sum1 += data[i];
+        sum2 += sum1;
+      }
+      return ((uint16_t)sum2 << 8) | sum1;
+    }
+
+  private:
+
+    static const uint16_t _magic = 0x5753;
+    static const unsigned long _maxAge = 5 /*minutes*/ * 60UL * 1000;
+    static const unsigned long _heartbeatInterval = 1 /*second*/ * 1000;
+
+    struct ZoneSnapshot
+    {
+      int16_t tempCelsius;
+      bool relayOn;
+      bool valid;
+      unsigned long savedAt;
+    };
+
+    struct Snapshot
+    {
+      uint16_t magic;
+      unsigned long aliveAt;
+      ZoneSnapshot zones[PersistedData::MAX_ZONES];
+      uint16_t checksum;
+    };
+
+    static Snapshot _snapshot;
+
+  public:
+
+    // The snapshot is static, so it isn't in sizeof(WarmStart).
+    static const unsigned int STATIC_BYTES = sizeof(Snapshot);
+};
+
+// Like the rest of the headers, this is only meant to be included by the single sketch file.
+// On the AVR the .noinit section is left alone by the startup code, so it survives a reset.
+#ifdef __AVR__
+WarmStart::Snapshot WarmStart::_snapshot __attribute__((section(".noinit")));
+#else
+WarmStart::Snapshot WarmStart::_snapshot;
+#endif
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "ArduinoWorker.h"
+#include "PersistedData.h"
+#include "Clock.h"
+
+#ifdef __AVR__
+#include <avr/wdt.h>
+#include <avr/interrupt.h>
+#endif
+
+// Resets the board if the workers stop running.  The hardware watchdog is only fed at the end of
+// a pass, and only if every critical worker has run within its max period.  So either a worker
+// that never returns (like a sensor read stuck on a bad line) or one that stops being run at all
+// ends in a reset, rather than the relay being left however it was.
+//
+// The watchdog interrupts just before it resets, which is when we note which worker was to
+// blame in a bit of RAM that survives the reset.  At the next boot that is saved with the
+// persisted data, so it can be looked at later.
+class Watchdog
+{
+  public:
+
+    Watchdog(ArdunioWorker * worker, PersistedData * storage)
+      : _worker(worker)
+      , _storage(storage)
+      , _lastCheck(0)
+    {
+    }
+
+    // After a watchdog reset it is still running (with the shortest timeout), so this has to
+    // be the very first thing in setup() or we could be reset again before we get to Begin().
+    static void Stop()
+    {
+#ifdef __AVR__
+      MCUSR &= ~(1 << WDRF);
+      wdt_disable();
+#endif
+    }
+
+    // Should be called at the end of setup(), once nothing slow is left to do.
+    void Begin()
+    {
+      if ( _magic == _record.magic )
+      {
+        _storage->RecordWatchdogReset(_record.worker);
+      }
+      _record.magic = 0;
+
+      _instance = this;
+      _lastCheck = Clock::Now();
+#ifdef __AVR__
+      // Interrupt at about 1s and then reset 1s after that.  Taking the interrupt clears WDIE,
+      // so the next timeout is the reset.
+      cli();
+      wdt_reset();
+      WDTCSR |= (1 << WDCE) | (1 << WDE);
+      WDTCSR = (1 << WDIE) | (1 << WDE) | (1 << WDP2) | (1 << WDP1);
+      sei();
+#endif
+    }
+
+    // Called at the end of each pass.  Going through the workers is only done every so often,
+    // and the loop is kept from sleeping longer than that so we're always back in time.
+    void Feed(unsigned long & delay)
+    {
+      unsigned long now = Clock::Now();
+      if ( now - _lastCheck >= _checkInterval )
+      {
+        _lastCheck = now;
+        uint8_t staleWorker;
+        if ( _worker->CheckLiveness(staleWorker) )
+        {
+#ifdef __AVR__
+          // If we were late enough for the interrupt it has cleared WDIE, and without it back
+          // the next timeout would reset us with nobody recorded.  Setting it doesn't need the
+          // timed sequence.
+          wdt_reset();
+          WDTCSR |= (1 << WDIE);
+#endif
+          _record.magic = 0;
+        }
+        else
+        {
+          // Not fed, so this is who to blame when the reset comes (unless one hangs first).
+          Record(staleWorker);
+        }
+      }
+      if ( delay > _checkInterval )
+      {
+        delay = _checkInterval;
+      }
+    }
+
+    // Called from the watchdog interrupt.
+    static void OnTimeout()
+    {
+      if ( nullptr == _instance )
+      {
+        return;
+      }
+      uint8_t running = _instance->_worker->GetRunningWorker();
+      if ( ( ArdunioWorker::NoWorker != running ) || ( _magic != _record.magic ) )
+      {
+        Record(running);
+      }
+    }
+
+  private:
+
+    static void Record(uint8_t worker)
+    {
+      _record.worker = worker;
+      _record.magic = _magic;
+    }
+
+  private:
+
+    static const uint16_t _magic = 0x5744;
+    static const unsigned long _checkInterval = 500 /*ms*/;
+
+    struct ResetRecord
+    {
+      uint16_t magic;
+      uint8_t worker;
+    };
+
+    ArdunioWorker * _worker;
+    PersistedData * _storage;
+    unsigned long _lastCheck;
+
+    static Watchdog * _instance;
+    static volatile ResetRecord _record;
+
+  public:
+
+    // The record is static, so it isn't in sizeof(Watchdog).
+    static const unsigned int STATIC_BYTES = sizeof(Watchdog *) + sizeof(ResetRecord);
+};
+
+// Like the rest of the headers, this is only meant to be included by the single sketch file.
+// The record is kept in .noinit for the same reason as WarmStart's snapshot (see WarmStart.h).
+Watchdog * Watchdog::_instance = nullptr;
+#ifdef __AVR__
+volatile Watchdog::ResetRecord Watchdog::_record __attribute__((section(".noinit")));
+
+ISR(WDT_vect)
+{
+  Watchdog::OnTimeout();
+}
+#else
+volatile Watchdog::ResetRecord Watchdog::_record;
+#endif
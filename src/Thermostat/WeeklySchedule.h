@@ -0,0 +1,264 @@
+#pragma once
+
+#include "ArduinoWorker.h"
+#include "PersistedData.h"
+#include "RealTimeClock.h"
+#include "Thermostat.h"
+
+// Moves every zone's trigger temp up or down (the setback) at set times of the week.  The week is
+// split into 15 minute slots and the schedule is kept as runs of slots with the same setback,
+// starting from Monday 00:00.  Each run is packed into 2 bytes, the length in the low 10 bits and
+// the setback (-32 to 31 fahrenheit) in the top 6, so a whole week of shifts fits in a few bytes
+// of EEPROM.  Anything past the last run has no setback.
+//
+// Rather than checking the schedule every pass, a timer is set for the end of the current run,
+// so the only work is a single step to the next run when it fires.  The whole schedule is only
+// looked through when the clock or the schedule itself changes.
+class WeeklySchedule
+{
+  public:
+
+    WeeklySchedule(PersistedData * storage, RealTimeClock * clock, Thermostat * thermostats, uint8_t zoneCount)
+      : _storage(storage)
+      , _clock(clock)
+      , _thermostats(thermostats)
+      , _zoneCount(zoneCount)
+      , _worker(nullptr)
+      , _timer(ArdunioWorker::InvalidTimer)
+      , _run(0)
+      , _runEnd(0)
+      , _setback(0)
+    {
+    }
+
+    void RegisterTimer(ArdunioWorker * worker)
+    {
+      _worker = worker;
+      _timer = _worker->AddTimer(this, &WeeklySchedule::NextRun);
+      Refresh();
+    }
+
+    // From this time of the week on (till the next run that was already there), the trigger is
+    // moved by the setback.  Returns false if the schedule is out of room.
+    bool AddTransition(uint8_t day, uint8_t hour, uint8_t minute, int setback)
+    {
+      if ( ( day >= 7 ) || ( hour >= 24 ) || ( minute >= 60 ) || ( setback < _minSetback ) || ( setback > _maxSetback ) )
+      {
+        return false;
+      }
+      uint16_t slot = ((day * 24 + hour) * 60 + minute) / _slotMinutes;
+
+      // Unpack into a run per slot boundary we need, with the part past the last run filled in.
+      uint16_t runs[PersistedData::MAX_SCHEDULE_RUNS + 2];
+      uint8_t count = _storage->get_ScheduleRuns();
+      uint16_t total = 0;
+      for ( uint8_t i = 0; i < count; ++i )
+      {
+        runs[i] = _storage->get_ScheduleRun(i);
+        total += GetLength(runs[i]);
+      }
+      if ( total < SLOTS_PER_WEEK )
+      {
+        runs[count++] = Pack(SLOTS_PER_WEEK - total, 0);
+      }
+
+      // Split the run the slot is in, so the new setback covers from the slot to the run's end.
+      uint16_t start = 0;
+      uint8_t i = 0;
+      while ( start + GetLength(runs[i]) <= slot )
+      {
+        start += GetLength(runs[i++]);
+      }
+      uint16_t end = start + GetLength(runs[i]);
+      if ( slot > start )
+      {
+        for ( uint8_t j = count; j > i; --j )
+        {
+          runs[j] = runs[j - 1];
+        }
+        ++count;
+        runs[i] = Pack(slot - start, GetSetback(runs[i]));
+        ++i;
+      }
+      runs[i] = Pack(end - slot, setback);
+
+      // Join any neighbours that ended up the same, and drop a trailing run with no setback
+      // since that is what is past the end anyway.
+      uint8_t packed = 0;
+      for ( uint8_t j = 0; j < count; ++j )
+      {
+        if ( ( packed > 0 ) && ( GetSetback(runs[packed - 1]) == GetSetback(runs[j]) ) )
+        {
+          runs[packed - 1] = Pack(GetLength(runs[packed - 1]) + GetLength(runs[j]), GetSetback(runs[j]));
+        }
+        else
+        {
+          runs[packed++] = runs[j];
+        }
+      }
+      if ( ( packed > 0 ) && ( 0 == GetSetback(runs[packed - 1]) ) )
+      {
+        --packed;
+      }
+      if ( packed > PersistedData::MAX_SCHEDULE_RUNS )
+      {
+        return false;
+      }
+
+      _storage->set_Schedule(runs, packed);
+      Refresh();
+      return true;
+    }
+
+    void Clear()
+    {
+      uint16_t none = 0;
+      _storage->set_Schedule(&none, 0);
+      Refresh();
+    }
+
+    // Finds the run we are in now and sets the timer for when it ends.  Only needed when the
+    // clock or the schedule changes, after that each run leads straight to the next.
+    void Refresh()
+    {
+      if ( !_clock->IsSet() || ( 0 == _storage->get_ScheduleRuns() ) )
+      {
+        _worker->CancelTimer(_timer);
+        ApplySetback(0);
+        return;
+      }
+
+      uint16_t slot = _clock->GetWeekSeconds() / _slotSeconds;
+      _run = 0;
+      _runEnd = 0;
+      while ( true )
+      {
+        _runEnd += GetRunLength(_run);
+        if ( slot < _runEnd )
+        {
+          break;
+        }
+        ++_run;
+      }
+      StartRun();
+    }
+
+    int GetCurrentSetback()
+    {
+      return _setback;
+    }
+
+    void PrintRuns(Print & out)
+    {
+      uint16_t start = 0;
+      for ( uint8_t run = 0; run < _storage->get_ScheduleRuns(); ++run )
+      {
+        uint16_t packed = _storage->get_ScheduleRun(run);
+        uint16_t minutes = start * _slotMinutes;
+        out.print(minutes / (24 * 60));
+        out.print(' ');
+        RealTimeClock::PrintTwoDigits(out, minutes / 60 % 24);
+        out.print(':');
+        RealTimeClock::PrintTwoDigits(out, minutes % 60);
+        out.print(' ');
+        out.println(GetSetback(packed));
+        start += GetLength(packed);
+      }
+    }
+
+  public:
+
+    static const uint16_t SLOTS_PER_WEEK = 7 * 24 * 4;
+
+  private:
+
+    // Called by the timer at the end of each run.
+    void NextRun()
+    {
+      if ( _runEnd >= SLOTS_PER_WEEK )
+      {
+        _run = 0;
+        _runEnd = 0;
+      }
+      else
+      {
+        ++_run;
+      }
+      _runEnd += GetRunLength(_run);
+      StartRun();
+    }
+
+    void StartRun()
+    {
+      ApplySetback(GetRunSetback(_run));
+
+      // Time the end of the run from the clock rather than the length, so the timer firing a
+      // little late never adds up.
+      unsigned long endSeconds = (unsigned long)_runEnd * _slotSeconds;
+      unsigned long nowSeconds = _clock->GetWeekSeconds();
+      unsigned long remaining = endSeconds > nowSeconds ? endSeconds - nowSeconds : 0;
+      _worker->StartTimer(_timer, remaining * 1000);
+    }
+
+    void ApplySetback(int setback)
+    {
+      _setback = setback;
+      for ( uint8_t zone = 0; zone < _zoneCount; ++zone )
+      {
+        _thermostats[zone].SetSetback(setback);
+      }
+    }
+
+    // The run after the last stored one is the rest of the week with no setback.
+    uint16_t GetRunLength(uint8_t run)
+    {
+      if ( run < _storage->get_ScheduleRuns() )
+      {
+        return GetLength(_storage->get_ScheduleRun(run));
+      }
+      return SLOTS_PER_WEEK - _runEnd;
+    }
+
+    int GetRunSetback(uint8_t run)
+    {
+      return run < _storage->get_ScheduleRuns() ? GetSetback(_storage->get_ScheduleRun(run)) : 0;
+    }
+
+    static uint16_t Pack(uint16_t length, int setback)
+    {
+      return (length & _lengthMask) | ((uint16_t)setback << _setbackShift);
+    }
+
+    static uint16_t GetLength(uint16_t packed)
+    {
+      return packed & _lengthMask;
+    }
+
+    static int GetSetback(uint16_t packed)
+    {
+      // Shifting the signed value back down brings the sign with it.
+      return (int16_t)packed >> _setbackShift;
+    }
+
+  private:
+
+    static const uint8_t _slotMinutes = 15;
+    static const unsigned long _slotSeconds = _slotMinutes * 60;
+    static const uint16_t _lengthMask = 0x03FF;
+    static const uint8_t _setbackShift = 10;
+    static const int _minSetback = -32;
+    static const int _maxSetback = 31;
+
+    PersistedData * _storage;
+    RealTimeClock * _clock;
+    Thermostat * _thermostats;
+    const uint8_t _zoneCount;
+
+    ArdunioWorker * _worker;
+    ArdunioWorker::TimerHandle _timer;
+
+    // The run we are in and the slot it ends at.
+    uint8_t _run;
+    uint16_t _runEnd;
+    int _setback;
+};
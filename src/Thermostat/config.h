@@ -7,6 +7,51 @@
 #define PIN_BUTTON_BLUE 11
 #define PIN_BUTTON_RED  12
 
+// Pick the type of temp sensor on the sensor pins.  The DHT11 is used if none are defined.  A
+// thermistor is read with analogRead(), so its PIN_HEAT_DIO_n has to be an analog pin (A0 to A7)
+// rather than the digital pins above.  Given a plain number like 4, analogRead() reads A4.
+//#define SENSOR_DS18B20
+//#define SENSOR_THERMISTOR
+
+// Each additional zone is a sensor and relay pair (up to PersistedData::MAX_ZONES in total).
+// Uncomment these to add zones, otherwise just the single zone above is run.
+//#define PIN_HEAT_DIO_2  5
+//#define PIN_RELAY_2     7
+//#define PIN_HEAT_DIO_3  2
+//#define PIN_RELAY_3     3
+//#define PIN_HEAT_DIO_4  10
+//#define PIN_RELAY_4     A0
+
+// The sensors are read more often the closer the temp is to the trigger (and the faster it is
+// heading there).  These bound how often that is (in ms).
+#define SENSOR_POLL_MIN (5UL * 1000)
+#define SENSOR_POLL_MAX (2UL * 60 * 1000)
+
+// If a zone's sensor hasn't given a good reading for this long (ms), its relay is forced to the
+// safe state until it does.  The relay is forced off unless this is uncommented.
+#define FAIL_SAFE_TIMEOUT (5UL * 60 * 1000)
+//#define FAIL_SAFE_RELAY_ON
+
+// Uncomment this to blank the display after this long (ms) with no button pressed, it comes back on
+// the next press.  Uncomment the brightness (0 to 7) as well to dim it to that instead.
+//#define DISPLAY_IDLE_TIMEOUT (5UL * 60 * 1000)
+//#define DISPLAY_IDLE_BRIGHTNESS 0
+
+// Uncomment this to dim the display in a dark room, from a light sensor on this analog pin (like
+// a photo resistor divider, higher is brighter).  The brightness setting is the most it goes to.
+//#define PIN_AMBIENT_LIGHT A1
+
+// Uncomment this to write out any settings that haven't been saved yet as soon as the supply drops
+// below this (mV), rather than after the usual delay.  The supply is measured against the chip's
+// 1.1V bandgap, which can be 10% out either way, so it needs calibrating first or a good supply
+// could look low (or a failing one fine).  Run any sketch that sets analogReference(INTERNAL),
+// measure AREF to ground with a meter and put that in SUPPLY_BANDGAP_MV.
+//#define SUPPLY_LOW_MV 4500
+//#define SUPPLY_BANDGAP_MV 1100
+
+// Comment this out to run without the watchdog.  It is never used while replaying a trace.
+#define WATCHDOG
+
 // You can comment this out to skip.
 //#define STARTUP_MSG "Hello Vedder    and Wynter"
 #define STARTUP_MSG "0123456789-_abcdefghijklmnopqrstuvwxyz"
@@ -14,3 +59,39 @@
 
 // You can comment this out to skip.
 #define BRIGHTNESS_TEST_DELAY 200
+
+// Uncomment this to time the core building blocks at startup and write the results as JSON
+// to the serial port at this baud rate.
+//#define BENCHMARK_BAUD 115200
+
+// Uncomment one of these to either record a trace of the button and sensor inputs (and relay
+// changes) to the serial port at this baud rate, or to replay a trace sent to the serial port
+// in place of the real buttons and sensors.  The replay writes its own trace back out.
+//#define TRACE_RECORD_BAUD 115200
+//#define TRACE_REPLAY_BAUD 115200
+
+// Uncomment this along with the replay to have each zone's sensor read a simulated room cooled by
+// its relay (see SimulatedPlant.h), rather than the temps in the trace.  The trace then only sets
+// how long to run for (and any button presses, supply drops or read costs).  At the end, a
+// summary of how each zone did is written as JSON in place of the trace.
+//#define SIMULATE_PLANT
+
+// Uncomment this along with the replay to time how long each button press in the trace takes to
+// show on the display (see InputLatency.h).  At the end, the percentiles and how long each stage
+// took are written as JSON in place of the trace.
+//#define INPUT_LATENCY
+
+// Uncomment this to take commands on the serial port at this baud rate to set the clock and the
+// weekly setback schedule (see SerialControl.h).
+//#define SERIAL_CONTROL_BAUD 115200
+
+// Uncomment this to write each zone's relay on time and switch counts as JSON to the serial
+// port at this baud rate every few minutes.
+//#define TELEMETRY_BAUD 115200
+
+// The static objects must fit in this many bytes of RAM, leaving the rest of the 2K for the heap
+// (the workers) and the stack.  That includes Serial and its buffers when any of the *_BAUD
+// options are on.  Uncomment the baud rate to also report the heap and stack high water marks
+// (and the static RAM as actually linked) to the serial port.
+#define STATIC_RAM_BUDGET 1152
+//#define MEMORY_REPORT_BAUD 115200
@@ -7,44 +7,432 @@
 #include "ButtonPress.h"
 #include "config.h"  // include last so no others use these directly
 
+#if defined(TRACE_REPLAY_BAUD)
+// When replaying a trace, the sensor readings come from it rather than the pins.
+#include "SimulatedSensor.h"
+typedef SimulatedSensor ZoneSensor;
+#elif defined(SENSOR_DS18B20)
+#include "DS18B20Sensor.h"
+typedef DS18B20Sensor ZoneSensor;
+#elif defined(SENSOR_THERMISTOR)
+#include "ThermistorSensor.h"
+typedef ThermistorSensor ZoneSensor;
+static_assert(PIN_HEAT_DIO >= A0, "A thermistor needs an analog pin (A0 to A7) for PIN_HEAT_DIO");
+#ifdef PIN_HEAT_DIO_2
+static_assert(PIN_HEAT_DIO_2 >= A0, "A thermistor needs an analog pin (A0 to A7) for PIN_HEAT_DIO_2");
+#endif
+#ifdef PIN_HEAT_DIO_3
+static_assert(PIN_HEAT_DIO_3 >= A0, "A thermistor needs an analog pin (A0 to A7) for PIN_HEAT_DIO_3");
+#endif
+#ifdef PIN_HEAT_DIO_4
+static_assert(PIN_HEAT_DIO_4 >= A0, "A thermistor needs an analog pin (A0 to A7) for PIN_HEAT_DIO_4");
+#endif
+#else
+#include "DHT11Sensor.h"
+typedef DHT11Sensor ZoneSensor;
+#endif
+
+#ifdef BENCHMARK_BAUD
+#include "Benchmark.h"
+#endif
+
+#if defined(TRACE_RECORD_BAUD) || defined(TRACE_REPLAY_BAUD)
+// A trace is binary, so it needs the serial port to itself.
+#if defined(TELEMETRY_BAUD) || defined(SERIAL_CONTROL_BAUD) || defined(MEMORY_REPORT_BAUD) || defined(BENCHMARK_BAUD)
+#error "TRACE_RECORD_BAUD and TRACE_REPLAY_BAUD can't share the serial port with the other *_BAUD options"
+#endif
+#if defined(TRACE_RECORD_BAUD) && defined(TRACE_REPLAY_BAUD)
+#error "Only one of TRACE_RECORD_BAUD and TRACE_REPLAY_BAUD can be on (the replay records what it does anyway)"
+#endif
+#include "Trace.h"
+#endif
+
+#ifdef SIMULATE_PLANT
+#ifndef TRACE_REPLAY_BAUD
+#error "SIMULATE_PLANT needs TRACE_REPLAY_BAUD to run on the virtual clock"
+#endif
+#include "SimulatedPlant.h"
+#endif
+
+#ifdef INPUT_LATENCY
+#ifndef TRACE_REPLAY_BAUD
+#error "INPUT_LATENCY needs TRACE_REPLAY_BAUD to script the button presses"
+#endif
+#include "InputLatency.h"
+#endif
+
+#include "WarmStart.h"
+#include "Watchdog.h"
+#include "RealTimeClock.h"
+#include "WeeklySchedule.h"
+
+#ifdef SUPPLY_LOW_MV
+#include "SupplyMonitor.h"
+#endif
+
+#ifdef SERIAL_CONTROL_BAUD
+#include "SerialControl.h"
+#endif
+
+#ifdef MEMORY_REPORT_BAUD
+#include "MemoryReport.h"
+#endif
+
+#ifdef TELEMETRY_BAUD
+#include "Telemetry.h"
+#endif
+
 ArdunioWorker worker;
+EventBus bus;
+#ifdef TRACE_REPLAY_BAUD
+// A replay works on a copy of the settings in RAM, so it never changes (or wears) the EEPROM.
+uint8_t storageImage[PersistedData::IMAGE_SIZE];
+PersistedData storage(storageImage);
+#else
 PersistedData storage;
-Thermostat thermostat(PIN_HEAT_DIO, &storage);
-RelayControl relay(PIN_RELAY);
-HeatDisplay display(PIN_DISPLAY_CLK, PIN_DISPLAY_DIO, &storage, &thermostat);
+#endif
+
+ZoneSensor sensors[] =
+{
+  { PIN_HEAT_DIO },
+#ifdef PIN_HEAT_DIO_2
+  { PIN_HEAT_DIO_2 },
+#endif
+#ifdef PIN_HEAT_DIO_3
+  { PIN_HEAT_DIO_3 },
+#endif
+#ifdef PIN_HEAT_DIO_4
+  { PIN_HEAT_DIO_4 },
+#endif
+};
+
+Thermostat thermostats[] =
+{
+  { &sensors[0], &storage, &bus, 0 },
+#ifdef PIN_HEAT_DIO_2
+  { &sensors[1], &storage, &bus, 1 },
+#endif
+#ifdef PIN_HEAT_DIO_3
+  { &sensors[2], &storage, &bus, 2 },
+#endif
+#ifdef PIN_HEAT_DIO_4
+  { &sensors[3], &storage, &bus, 3 },
+#endif
+};
+
+RelayControl relays[] =
+{
+  { PIN_RELAY, &storage, 0 },
+#ifdef PIN_RELAY_2
+  { PIN_RELAY_2, &storage, 1 },
+#endif
+#ifdef PIN_RELAY_3
+  { PIN_RELAY_3, &storage, 2 },
+#endif
+#ifdef PIN_RELAY_4
+  { PIN_RELAY_4, &storage, 3 },
+#endif
+};
+
+const uint8_t zoneCount = sizeof(thermostats) / sizeof(thermostats[0]);
+
+// The zones are indexed together, so a PIN_HEAT_DIO_n without its PIN_RELAY_n (or the other way
+// round) would have a thermostat switching a relay that isn't there.
+static_assert(sizeof(relays) / sizeof(relays[0]) == zoneCount, "Each zone needs both a PIN_HEAT_DIO_n and a PIN_RELAY_n");
+
+HeatDisplay display(PIN_DISPLAY_CLK, PIN_DISPLAY_DIO, &storage, thermostats, relays, zoneCount);
 ButtonPress buttonRed(PIN_BUTTON_RED);
 ButtonPress buttonBlue(PIN_BUTTON_BLUE);
+WarmStart warmStart;
+Watchdog watchdog(&worker, &storage);
+RealTimeClock rtc;
+WeeklySchedule schedule(&storage, &rtc, thermostats, zoneCount);
+
+#ifdef SUPPLY_LOW_MV
+#ifdef SUPPLY_BANDGAP_MV
+SupplyMonitor supply(SUPPLY_LOW_MV, SUPPLY_BANDGAP_MV);
+#else
+SupplyMonitor supply(SUPPLY_LOW_MV);
+#endif
+#endif
+
+#if defined(TRACE_RECORD_BAUD) || defined(TRACE_REPLAY_BAUD)
+TraceRecorder recorder(Serial, &worker);
+#endif
+
+#ifdef SIMULATE_PLANT
+SimulatedPlant plants[] =
+{
+  { &sensors[0], &relays[0], &thermostats[0] },
+#ifdef PIN_HEAT_DIO_2
+  { &sensors[1], &relays[1], &thermostats[1] },
+#endif
+#ifdef PIN_HEAT_DIO_3
+  { &sensors[2], &relays[2], &thermostats[2] },
+#endif
+#ifdef PIN_HEAT_DIO_4
+  { &sensors[3], &relays[3], &thermostats[3] },
+#endif
+};
+#endif
+
+#ifdef INPUT_LATENCY
+InputLatency latency(&display.GetSegments());
+#endif
+
+#ifdef SERIAL_CONTROL_BAUD
+SerialControl serialControl(Serial, &rtc, &schedule);
+#endif
+
+#ifdef TELEMETRY_BAUD
+Telemetry telemetry(Serial, thermostats, relays, zoneCount, &display);
+#endif
+
+// Everything above lives in RAM for good, so make sure it all still fits with room for the stack.
+// The sizes only mean something for the AVR build, where pointers and ints are 2 bytes.  Serial
+// holds its own buffers, so it counts whenever anything uses it.
+constexpr unsigned int staticRam = sizeof(worker) + sizeof(bus) + sizeof(storage) + sizeof(sensors) + sizeof(thermostats)
+  + sizeof(relays) + sizeof(display) + sizeof(buttonRed) + sizeof(buttonBlue)
+  + sizeof(warmStart) + WarmStart::STATIC_BYTES + sizeof(watchdog) + Watchdog::STATIC_BYTES + sizeof(rtc) + sizeof(schedule)
+#ifdef SUPPLY_LOW_MV
+  + sizeof(supply)
+#endif
+#if defined(TRACE_RECORD_BAUD) || defined(TRACE_REPLAY_BAUD)
+  + sizeof(recorder)
+#endif
+#ifdef TRACE_REPLAY_BAUD
+  + sizeof(storageImage)
+#endif
+#ifdef SIMULATE_PLANT
+  + sizeof(plants)
+#endif
+#ifdef INPUT_LATENCY
+  + sizeof(latency)
+#endif
+#ifdef SERIAL_CONTROL_BAUD
+  + sizeof(serialControl)
+#endif
+#ifdef TELEMETRY_BAUD
+  + sizeof(telemetry)
+#endif
+#ifdef MEMORY_REPORT_BAUD
+  + sizeof(MemoryReport)
+#endif
+#if defined(SERIAL_CONTROL_BAUD) || defined(TELEMETRY_BAUD) || defined(MEMORY_REPORT_BAUD) || defined(BENCHMARK_BAUD) || defined(TRACE_RECORD_BAUD) || defined(TRACE_REPLAY_BAUD)
+  + sizeof(Serial)
+#endif
+  ;
+#ifdef __AVR__
+static_assert(staticRam <= STATIC_RAM_BUDGET, "The static objects have gone over STATIC_RAM_BUDGET");
+#endif
+
+#ifdef MEMORY_REPORT_BAUD
+MemoryReport memoryReport(Serial, staticRam, STATIC_RAM_BUDGET);
+#endif
 
 void setup()
 {
+  // If a watchdog reset got us here it is still running, so it has to be stopped before
+  // anything else.  It is started again at the end.
+  Watchdog::Stop();
+
+  // Then put each zone's relay back how it was if we were only reset, so it
+  // isn't left in the wrong state while everything else starts up.
+  for ( uint8_t zone = 0; zone < zoneCount; ++zone )
+  {
+    int tempCelsius;
+    bool relayOn;
+    if ( warmStart.Restore(zone, tempCelsius, relayOn) )
+    {
+      relays[zone].Restore(relayOn);
+      thermostats[zone].Restore(tempCelsius);
+    }
+  }
+  warmStart.Start();
+  bus.Subscribe(EventTemp | EventRelay, PASS_OBJECT_METHOD(warmStart, OnEvent));
+  worker.AddWorker(PASS_OBJECT_METHOD(warmStart, Heartbeat), PriorityPersistence);
+
+  // The sensors, relays and buttons are critical, they each have to keep running at least this
+  // often or the watchdog will reset us.
+  const unsigned long sensorMaxPeriod = 2 * SENSOR_POLL_MAX;
+  const unsigned long relayMaxPeriod = 2 * RelayControl::UPDATE_INTERVAL;
+  const unsigned long buttonMaxPeriod = 1 /*second*/ * 1000;
+
+#ifdef MEMORY_REPORT_BAUD
+  memoryReport.PaintStack();
+  Serial.begin(MEMORY_REPORT_BAUD);
+  memoryReport.PrintObject(F("worker"), sizeof(worker));
+  memoryReport.PrintObject(F("bus"), sizeof(bus));
+  memoryReport.PrintObject(F("storage"), sizeof(storage));
+  memoryReport.PrintObject(F("sensors"), sizeof(sensors));
+  memoryReport.PrintObject(F("thermostats"), sizeof(thermostats));
+  memoryReport.PrintObject(F("relays"), sizeof(relays));
+  memoryReport.PrintObject(F("display"), sizeof(display));
+  memoryReport.PrintObject(F("buttons"), sizeof(buttonRed) + sizeof(buttonBlue));
+  worker.AddWorker(PASS_OBJECT_METHOD(memoryReport, Report), PriorityPersistence);
+  worker.AddPassCompleteHandler(PASS_OBJECT_METHOD(memoryReport, SampleHeap));
+#endif
+
+#ifdef BENCHMARK_BAUD
+  Serial.begin(BENCHMARK_BAUD);
+  Benchmark benchmark(Serial);
+  benchmark.RunAll(PIN_DISPLAY_CLK, PIN_DISPLAY_DIO, PIN_BUTTON_RED);
+#endif
+
   // The persisted storage object needs to be called to ensure it saves any config changes.
-  worker.AddWorker(PASS_OBJECT_METHOD(storage, SaveData));
+  worker.AddWorker(PASS_OBJECT_METHOD(storage, SaveData), PriorityPersistence);
 
-  // The thermostat needs to refresh the temp and notify the relay and display.
-  thermostat.RegisterRelayHandler(PASS_OBJECT_METHOD(relay, ChangeState));
-  thermostat.RegisterTempHandler(PASS_OBJECT_METHOD(display, UpdateHeatCelsius));
-  worker.AddWorker(PASS_OBJECT_METHOD(thermostat, RefreshTemp));
+#ifdef SUPPLY_LOW_MV
+  // Those are held for a few seconds to save them all at once, unless the power is going.
+  supply.RegisterLowHandler(PASS_OBJECT_METHOD(storage, Flush));
+  worker.AddWorker(PASS_OBJECT_METHOD(supply, CheckSupply), PriorityInput);
+#endif
+
+  // Each zone's thermostat needs to refresh the temp and notify its relay and the display.
+  // The sensor reads are staggered so no two zones are ever read in the same pass.  Each zone
+  // keeps to its own slot however its polls vary.  The first zone is read in the very first pass,
+  // since the control workers run before the timers that play the startup message and brightness
+  // test.
+  for ( uint8_t zone = 0; zone < zoneCount; ++zone )
+  {
+    bus.Subscribe(EventRelay, &relays[zone], &RelayControl::OnRelayEvent, zone);
+    relays[zone].SetClock(&rtc);
+    thermostats[zone].SetPollBounds(SENSOR_POLL_MIN, SENSOR_POLL_MAX);
+    if ( zoneCount > 1 )
+    {
+      thermostats[zone].SetReadSlot(zone * Thermostat::SENSOR_STAGGER, zoneCount * Thermostat::SENSOR_STAGGER);
+    }
+#ifdef FAIL_SAFE_RELAY_ON
+    thermostats[zone].SetFailSafe(FAIL_SAFE_TIMEOUT, true);
+#else
+    thermostats[zone].SetFailSafe(FAIL_SAFE_TIMEOUT, false);
+#endif
+    worker.AddWorker(&thermostats[zone], &Thermostat::RefreshTemp, PriorityControl, zone * Thermostat::SENSOR_STAGGER, sensorMaxPeriod);
+    worker.AddWorker(&relays[zone], &RelayControl::UpdateStats, PriorityPersistence, 0, relayMaxPeriod);
+  }
+  bus.Subscribe(EventTemp, PASS_OBJECT_METHOD(display, OnTempEvent));
+
+  // The display uses timers to blink and time out of config mode (and to blank when idle).
+#ifdef DISPLAY_IDLE_TIMEOUT
+  display.SetIdleTimeout(DISPLAY_IDLE_TIMEOUT);
+#endif
+#ifdef DISPLAY_IDLE_BRIGHTNESS
+  display.SetIdleBrightness((DisplaySegments::Brightness)DISPLAY_IDLE_BRIGHTNESS);
+#endif
+  display.RegisterTimers(&worker);
+
+#ifdef PIN_AMBIENT_LIGHT
+  display.SetAmbientLight(PIN_AMBIENT_LIGHT);
+  worker.AddWorker(PASS_OBJECT_METHOD(display, CheckAmbientLight), PriorityDisplay);
+#endif
+
+  // The schedule only needs a timer for when the setback next changes.
+  schedule.RegisterTimer(&worker);
 
-  // Create a handler to blink the display when needed.
-  worker.AddWorker(PASS_OBJECT_METHOD(display, HandleBlink));
+  // And one to cycle the display between its pages (and zones if there is more than one).
+  worker.AddWorker(PASS_OBJECT_METHOD(display, CyclePages), PriorityDisplay);
+
+  // At the end of each pass, the events published during it are dispatched and then
+  // the display repaints once, however many changes were made in the pass.  The display
+  // also sends the next bit of any changed frame, so the bus never holds up the loop.
+  worker.AddPassCompleteHandler(PASS_OBJECT_METHOD(bus, Dispatch));
+  worker.AddPassCompleteHandler(PASS_OBJECT_METHOD(display, Render));
 
   // The red (up) button need to be monitored for press and notify the display when the occur. 
+  buttonRed.RegisterPressHandler(PASS_OBJECT_METHOD(display, OnButtonPress));
   buttonRed.RegisterShortPressHandler(PASS_OBJECT_METHOD(display, ChangeConfigUp));
   buttonRed.RegisterLongPressHandler(PASS_OBJECT_METHOD(display, ChangeConfigMode), HeatDisplay::BUTTON_LONG_PRESS);
-  worker.AddWorker(PASS_OBJECT_METHOD(buttonRed, CheckButton));
+  buttonRed.RegisterRepeatHandler(PASS_OBJECT_METHOD(display, RepeatConfigUp), HeatDisplay::BUTTON_REPEAT_DELAY);
+  worker.AddWorker(PASS_OBJECT_METHOD(buttonRed, CheckButton), PriorityInput, 0, buttonMaxPeriod);
 
   // Same for the blue (down) button.
+  buttonBlue.RegisterPressHandler(PASS_OBJECT_METHOD(display, OnButtonPress));
   buttonBlue.RegisterShortPressHandler(PASS_OBJECT_METHOD(display, ChangeConfigDown));
   buttonBlue.RegisterLongPressHandler(PASS_OBJECT_METHOD(display, ChangeMeasurement), HeatDisplay::BUTTON_LONG_PRESS);
-  worker.AddWorker(PASS_OBJECT_METHOD(buttonBlue, CheckButton));
+  buttonBlue.RegisterRepeatHandler(PASS_OBJECT_METHOD(display, RepeatConfigDown), HeatDisplay::BUTTON_REPEAT_DELAY);
+  worker.AddWorker(PASS_OBJECT_METHOD(buttonBlue, CheckButton), PriorityInput, 0, buttonMaxPeriod);
 
+  // These play out while the workers run, so they don't delay the first temp reads.
 #ifdef STARTUP_MSG
-  display.DisplayMessage(STARTUP_MSG, STARTUP_SPEED);
+  display.DisplayMessage(F(STARTUP_MSG), STARTUP_SPEED);
 #endif
 
 #ifdef BRIGHTNESS_TEST_DELAY
   display.TestBrightness(BRIGHTNESS_TEST_DELAY);
 #endif
+
+#ifdef SERIAL_CONTROL_BAUD
+  Serial.begin(SERIAL_CONTROL_BAUD);
+  worker.AddWorker(PASS_OBJECT_METHOD(serialControl, CheckInput), PriorityInput);
+#endif
+
+#ifdef TELEMETRY_BAUD
+  Serial.begin(TELEMETRY_BAUD);
+  worker.AddWorker(PASS_OBJECT_METHOD(telemetry, Report), PriorityPersistence);
+#endif
+
+#ifdef TRACE_RECORD_BAUD
+  Serial.begin(TRACE_RECORD_BAUD);
+  recorder.Watch(&buttonRed);
+  recorder.Watch(&buttonBlue);
+  recorder.Watch(&bus);
+#endif
+
+#ifdef TRACE_REPLAY_BAUD
+  // The replay takes over the clock and runs the workers itself till the trace ends.
+  Serial.begin(TRACE_REPLAY_BAUD);
+  TraceReplay replay(&worker);
+  replay.AddButton(&buttonRed);
+  replay.AddButton(&buttonBlue);
+#ifdef SIMULATE_PLANT
+  // The plants set the temps, so the sensors only take how long a read blocks from the trace.
+  for ( uint8_t zone = 0; zone < zoneCount; ++zone )
+  {
+    worker.AddWorker(&plants[zone], &SimulatedPlant::Step, PriorityControl);
+    replay.AddSensor(&sensors[zone], false);
+  }
+#else
+  for ( uint8_t zone = 0; zone < zoneCount; ++zone )
+  {
+    replay.AddSensor(&sensors[zone]);
+  }
+#endif
+#ifdef INPUT_LATENCY
+  // This has to come after the display's handler, so the pass has been drawn by the time it runs.
+  latency.Watch(&buttonRed);
+  latency.Watch(&buttonBlue);
+  worker.AddPassCompleteHandler(PASS_OBJECT_METHOD(latency, OnPassComplete));
+#endif
+#if !defined(SIMULATE_PLANT) && !defined(INPUT_LATENCY)
+  recorder.Watch(&bus);
+#endif
+#ifdef SUPPLY_LOW_MV
+  replay.AddSupply(&supply);
+#endif
+  replay.Run(Serial);
+#ifdef SIMULATE_PLANT
+  for ( uint8_t zone = 0; zone < zoneCount; ++zone )
+  {
+    plants[zone].Report(Serial);
+  }
+  Serial.print(F("{\"eeprom_writes\":"));
+  Serial.print(storage.GetEepromWrites());
+  Serial.println('}');
+#endif
+#ifdef INPUT_LATENCY
+  latency.Report(Serial);
+#endif
+#if !defined(SIMULATE_PLANT) && !defined(INPUT_LATENCY)
+  recorder.End();
+#endif
+#endif
+
+#if defined(WATCHDOG) && !defined(TRACE_REPLAY_BAUD)
+  // This goes last so nothing slow above (like the benchmark) can trip it.  It is fed at the
+  // end of every pass (once the events are out and the display is drawn).
+  watchdog.Begin();
+  worker.AddPassCompleteHandler(PASS_OBJECT_METHOD(watchdog, Feed));
+#endif
 }
 
 void loop()